@@ -57,6 +57,8 @@ Binder::Binder() : scopes() {
   enter_primitive("print_int", boost::none, {s_int});
   enter_primitive("flush", boost::none, {});
   enter_primitive("getchar", s_string, {});
+  enter_primitive("read_line", s_string, {});
+  enter_primitive("read_all", s_string, {});
   enter_primitive("ord", s_int, {s_string});
   enter_primitive("chr", s_string, {s_int});
   enter_primitive("size", s_int, {s_string});
@@ -1,4 +1,6 @@
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <cassert>
 #include <iostream>
 
 #include "../ast/ast_dumper.hh"
@@ -8,9 +10,42 @@
 #include "../parser/parser_driver.hh"
 #include "../irgen/irgen.hh"
 #include "../utils/errors.hh"
+#include "../utils/nolocation.hh"
+
+// The binder of the prebuilt libast predates the read_line and read_all
+// primitives. Declare them in a let around the program, which the program
+// may shadow like any other primitive, and return that let. Its body is
+// the program itself.
+static Let *declare_primitives(Expr *program) {
+  std::vector<Decl *> primitives;
+  for (const char *name : {"read_line", "read_all"}) {
+    // The binder insists on a body, but it is never generated.
+    primitives.push_back(new FunDecl(
+        utils::nl, Symbol(name), {},
+        new StringLiteral(utils::nl, Symbol("")), Symbol("string"), true));
+  }
+  return new Let(utils::nl, primitives, new Sequence(utils::nl, {program}));
+}
+
+// Once the program is bound, take the let built by declare_primitives out
+// of the AST, so that its declarations are seen by the later passes only
+// through the calls referring to them, as for the primitives of the binder.
+static void detach_primitives(FunDecl &main, Let &let) {
+  std::vector<Expr *> &body =
+      dynamic_cast<Sequence &>(main.get_expr().get()).get_exprs();
+  assert(body.front() == &let);
+  body.front() = let.get_sequence().get_exprs().front();
+  for (Decl *decl : let.get_decls()) {
+    FunDecl &primitive = dynamic_cast<FunDecl &>(*decl);
+    primitive.get_external_name() = Symbol("__" + primitive.name.get());
+  }
+}
 
 int main(int argc, char **argv) {
   std::string output_file;
+  std::string runtime_file;
+  std::string object_prefix;
+  unsigned jobs;
   std::vector<std::string> input_files;
   namespace po = boost::program_options;
   po::options_description options("Options");
@@ -18,9 +53,17 @@ int main(int argc, char **argv) {
   ("help,h", "describe arguments")
   ("dump-ast", "dump the parsed AST")
   ("dump-ir", "dump the generated IR")
+  ("escape-stats", "report how many escaping variables stay out of frames")
   ("bind,b", "run the binder on the parsed AST")
   ("type,t", "run the type checker on the parsed AST")
   ("irgen,i", "run the LLVM IR code generator")
+  ("debug,g", "emit debug information in the generated IR")
+  ("emit-obj", po::value(&object_prefix),
+   "optimize the IR and compile it into PREFIX.0.o, PREFIX.1.o, etc.")
+  ("jobs,j", po::value(&jobs)->default_value(1),
+   "number of objects compiled in parallel by --emit-obj")
+  ("runtime-bc", po::value(&runtime_file),
+   "link the runtime bitcode into the generated IR")
   ("trace-parser", "enable parser traces")
   ("trace-lexer", "enable lexer traces")
   ("verbose,v", "be verbose")
@@ -55,7 +98,9 @@ int main(int argc, char **argv) {
   FunDecl *main = nullptr;
   if (vm.count("bind") || vm.count("type") || vm.count("irgen")) {
     ast::binder::Binder binder;
-    main = binder.analyze_program(*parser_driver.result_ast);
+    Let *const primitives = declare_primitives(parser_driver.result_ast);
+    main = binder.analyze_program(*primitives);
+    detach_primitives(*main, *primitives);
     ast::escaper::Escaper escaper;
     main->accept(escaper);
   }
@@ -67,11 +112,26 @@ int main(int argc, char **argv) {
 
   if (vm.count("irgen")) {
     irgen::IRGenerator ir_generator;
+    if (vm.count("debug")) {
+      ir_generator.enable_debug_info(input_files[0]);
+    }
     ir_generator.generate_program(main);
 
+    if (!runtime_file.empty()) {
+      ir_generator.link_runtime(runtime_file);
+    }
+
     if (vm.count("dump-ir")) {
       ir_generator.print_ir(&std::cout);
     }
+
+    if (vm.count("escape-stats")) {
+      ir_generator.print_escape_stats(&std::cerr);
+    }
+
+    if (!object_prefix.empty()) {
+      ir_generator.emit_objects(object_prefix, std::max(jobs, 1u));
+    }
   }
 
   if (vm.count("dump-ast")) {
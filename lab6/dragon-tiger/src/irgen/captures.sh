@@ -0,0 +1,34 @@
+#! /bin/sh
+#
+# Check that a variable captured by value by a lifted function is read
+# after the arguments of the call, which may assign it. Prints its
+# results in the TAP format.
+
+DTIGER=${DTIGER:-../driver/dtiger}
+OPT=${OPT:-opt}
+
+tmp=$(mktemp)
+trap 'rm -f $tmp' EXIT
+
+echo "1..2"
+
+$DTIGER -i --dump-ir - <<EOF | $OPT -O3 -S -o $tmp -
+let var x := 1
+    function g(n: int): int = x + n
+in x := 2;
+   print_int(g((x := 5; 0)))
+end
+EOF
+
+if grep -q '^define.*@main' $tmp; then
+  echo "ok 1 - the program is compiled and optimized"
+else
+  echo "not ok 1 - the program is compiled and optimized"
+fi
+
+# Once g is inlined, the printed value is known.
+if grep -q '@__print_int(i32 5)' $tmp; then
+  echo "ok 2 - g sees the value assigned by its argument"
+else
+  echo "not ok 2 - g sees the value assigned by its argument"
+fi
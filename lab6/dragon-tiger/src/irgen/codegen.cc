@@ -0,0 +1,134 @@
+#include <thread>
+
+#include "irgen.hh"
+#include "../utils/errors.hh"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+using utils::error;
+
+namespace irgen {
+
+namespace {
+
+// Same target as llc run without -mcpu on the generated IR.
+std::unique_ptr<llvm::TargetMachine>
+create_target_machine(const std::string &triple) {
+  std::string message;
+  const llvm::Target *const target =
+      llvm::TargetRegistry::lookupTarget(triple, message);
+  if (!target)
+    error("cannot find target " + triple + ": " + message);
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, "generic", "", llvm::TargetOptions(), llvm::Reloc::PIC_,
+      llvm::None, llvm::CodeGenOpt::Aggressive));
+}
+
+// Run the same pipeline as opt -O3.
+void optimize(llvm::Module &module, llvm::TargetMachine &machine) {
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = 3;
+  builder.Inliner = llvm::createFunctionInliningPass(3, 0, false);
+  builder.LoopVectorize = true;
+  builder.SLPVectorize = true;
+  machine.adjustPassManager(builder);
+
+  llvm::legacy::FunctionPassManager function_passes(&module);
+  function_passes.add(llvm::createTargetTransformInfoWrapperPass(
+      machine.getTargetIRAnalysis()));
+  builder.populateFunctionPassManager(function_passes);
+
+  llvm::legacy::PassManager passes;
+  passes.add(llvm::createTargetTransformInfoWrapperPass(
+      machine.getTargetIRAnalysis()));
+  builder.populateModulePassManager(passes);
+
+  function_passes.doInitialization();
+  for (auto &fun : module)
+    function_passes.run(fun);
+  function_passes.doFinalization();
+  passes.run(module);
+}
+
+// Run the code generator on one partition. Every partition gets its
+// own context so that they can be processed in parallel.
+void compile_partition(const llvm::SmallVectorImpl<char> &bitcode,
+                       const std::string &filename) {
+  llvm::LLVMContext context;
+  llvm::Expected<std::unique_ptr<llvm::Module>> parsed =
+      llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()),
+                                filename),
+          context);
+  if (!parsed)
+    error("cannot read partition " + filename + ": " +
+          llvm::toString(parsed.takeError()));
+  llvm::Module &module = **parsed;
+  std::unique_ptr<llvm::TargetMachine> machine =
+      create_target_machine(module.getTargetTriple());
+
+  std::error_code error_code;
+  llvm::raw_fd_ostream output(filename, error_code, llvm::sys::fs::F_None);
+  if (error_code)
+    error("cannot open " + filename + ": " + error_code.message());
+  llvm::legacy::PassManager passes;
+  if (machine->addPassesToEmitFile(passes, output, nullptr,
+                                   llvm::TargetMachine::CGFT_ObjectFile))
+    error("cannot emit object files for " + module.getTargetTriple());
+  passes.run(module);
+}
+
+} // namespace
+
+void IRGenerator::set_native_target() {
+  llvm::InitializeNativeTarget();
+  Mod->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  Mod->setDataLayout(
+      create_target_machine(Mod->getTargetTriple())->createDataLayout());
+}
+
+void IRGenerator::emit_objects(const std::string &prefix, unsigned jobs) {
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  std::unique_ptr<llvm::TargetMachine> machine =
+      create_target_machine(Mod->getTargetTriple());
+
+  // Optimize before splitting: once split, functions called from
+  // another partition are made external (with hidden visibility) and
+  // could no longer be dropped after being inlined. Most of the time of
+  // the pipeline goes to inlining and the simplifications following it,
+  // so only code generation runs in parallel.
+  optimize(*Mod, *machine);
+
+  // Partitions are serialized one after the other, in a deterministic
+  // order, before the code generator runs on them in parallel.
+  std::vector<llvm::SmallVector<char, 0>> partitions;
+  llvm::SplitModule(std::move(Mod), jobs,
+                    [&](std::unique_ptr<llvm::Module> partition) {
+                      partitions.emplace_back();
+                      llvm::raw_svector_ostream stream(partitions.back());
+                      llvm::WriteBitcodeToFile(*partition, stream);
+                    });
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < partitions.size(); i++)
+    threads.emplace_back(compile_partition, std::cref(partitions[i]),
+                         prefix + "." + std::to_string(i) + ".o");
+  for (auto &thread : threads)
+    thread.join();
+}
+
+} // namespace irgen
@@ -0,0 +1,347 @@
+
+#include "frames.hh"
+
+namespace irgen {
+
+FrameAnalysis::FrameAnalysis() : current_function(nullptr) {}
+
+void FrameAnalysis::analyze(const FunDecl &main) {
+  main.accept(*this);
+  compute_captures();
+  compute_lifting();
+  compute_frames();
+  compute_recursion();
+}
+
+void FrameAnalysis::compute_captures() {
+  for (auto fun : functions) {
+    FunInfo &info = fun_infos[fun];
+    for (auto var : info.uses.elements)
+      if (var_infos[var].owner != fun)
+        info.captures.insert(var);
+  }
+
+  // A function must also provide the captured variables of the functions
+  // it calls, unless it declares them itself.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto fun : functions) {
+      FunInfo &info = fun_infos[fun];
+      for (auto callee : info.callees.elements)
+        for (auto var : fun_infos[callee].captures.elements)
+          if (var_infos[var].owner != fun)
+            changed |= info.captures.insert(var);
+    }
+  }
+}
+
+void FrameAnalysis::compute_lifting() {
+  for (auto fun : functions) {
+    FunInfo &info = fun_infos[fun];
+    info.lifted = fun->get_parent() &&
+                  info.captures.elements.size() <= max_lifted_captures;
+  }
+
+  // Start optimistically and keep the static link of the functions which
+  // cannot do without it, until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto fun : functions) {
+      FunInfo &info = fun_infos[fun];
+      if (info.lifted) {
+        // A lifted function has no way to reach an outer frame, so it can
+        // only call functions needing a static link if it is their parent.
+        for (auto callee : info.callees.elements)
+          if (!fun_infos[callee].lifted &&
+              &callee->get_parent().get() != fun) {
+            info.lifted = false;
+            changed = true;
+            break;
+          }
+        continue;
+      }
+
+      // Every function crossed by the static link walks of this one must
+      // keep its own static link.
+      for (auto var : info.captures.elements)
+        unlift_up_to(*fun, *var_infos[var].owner, changed);
+      for (auto callee : info.callees.elements)
+        if (!fun_infos[callee].lifted)
+          unlift_up_to(*fun, callee->get_parent().get(), changed);
+    }
+  }
+}
+
+void FrameAnalysis::compute_frames() {
+  // Variables needed by a function which keeps its static link are
+  // reached by walking the frames, so they have to live there.
+  for (auto fun : functions) {
+    const FunInfo &info = fun_infos[fun];
+    if (!info.lifted)
+      for (auto var : info.captures.elements)
+        var_infos[var].frame_position = 0;
+  }
+
+  // A function only takes a static link to walk up the frames, either
+  // to reach its captured variables or to pass their static link to the
+  // functions it calls, and only when these are declared above it. The
+  // functions crossed on the way keep their own static link in a slot
+  // of their frame. Passing a static link may require one in turn, so
+  // this runs until nothing changes. A function whose parent has no
+  // frame thus never takes a static link.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto fun : functions) {
+      const FunInfo &info = fun_infos[fun];
+      if (info.lifted || !fun->get_parent())
+        continue;
+      for (auto var : info.captures.elements)
+        link_up_to(*fun, *var_infos[var].owner, changed);
+      for (auto callee : info.callees.elements)
+        if (fun_infos[callee].static_link &&
+            &callee->get_parent().get() != fun)
+          link_up_to(*fun, callee->get_parent().get(), changed);
+    }
+  }
+
+  // Lay out every frame once, in declaration order.
+  for (auto fun : functions) {
+    FunInfo &info = fun_infos[fun];
+    int position = info.link_slot ? 1 : 0;
+    for (auto var : info.decls) {
+      VarInfo &var_info = var_infos[var];
+      if (var_info.frame_position < 0)
+        continue;
+      var_info.frame_position = position++;
+      info.frame.push_back(var);
+    }
+  }
+}
+
+void FrameAnalysis::compute_recursion() {
+  for (auto fun : functions) {
+    FunInfo &info = fun_infos[fun];
+    std::vector<const FunDecl *> pending = info.callees.elements;
+    while (!pending.empty()) {
+      const FunDecl *const callee = pending.back();
+      pending.pop_back();
+      if (info.reachable.insert(callee).second)
+        for (auto next : fun_infos[callee].callees.elements)
+          pending.push_back(next);
+    }
+    info.recursive = info.reachable.count(fun);
+  }
+}
+
+void FrameAnalysis::unlift_up_to(const FunDecl &from, const FunDecl &target,
+                                 bool &changed) {
+  for (const FunDecl *fun = &from; fun != &target;) {
+    FunInfo &info = fun_infos[fun];
+    if (fun != &from && info.lifted) {
+      info.lifted = false;
+      changed = true;
+    }
+    fun = &fun->get_parent().get();
+  }
+}
+
+void FrameAnalysis::link_up_to(const FunDecl &from, const FunDecl &target,
+                               bool &changed) {
+  for (const FunDecl *fun = &from; fun != &target;) {
+    FunInfo &info = fun_infos[fun];
+    if (!info.static_link) {
+      info.static_link = true;
+      changed = true;
+    }
+    if (fun != &from && !info.link_slot) {
+      info.link_slot = true;
+      changed = true;
+    }
+    fun = &fun->get_parent().get();
+  }
+}
+
+bool FrameAnalysis::is_lifted(const FunDecl &decl) const {
+  auto info = fun_infos.find(&decl);
+  return info != fun_infos.end() && info->second.lifted;
+}
+
+bool FrameAnalysis::is_recursive(const FunDecl &decl) const {
+  return fun_infos.at(&decl).recursive;
+}
+
+bool FrameAnalysis::in_same_cycle(const FunDecl &a,
+                                  const FunDecl &b) const {
+  return fun_infos.at(&a).reachable.count(&b) &&
+         fun_infos.at(&b).reachable.count(&a);
+}
+
+bool FrameAnalysis::has_static_link(const FunDecl &decl) const {
+  auto info = fun_infos.find(&decl);
+  return info != fun_infos.end() && info->second.static_link;
+}
+
+bool FrameAnalysis::has_link_slot(const FunDecl &decl) const {
+  return fun_infos.at(&decl).link_slot;
+}
+
+bool FrameAnalysis::needs_frame(const FunDecl &decl) const {
+  const FunInfo &info = fun_infos.at(&decl);
+  return info.link_slot || !info.frame.empty();
+}
+
+const std::vector<const VarDecl *> &
+FrameAnalysis::get_captures(const FunDecl &decl) const {
+  return fun_infos.at(&decl).captures.elements;
+}
+
+bool FrameAnalysis::is_captured_by_reference(const VarDecl &decl) const {
+  return var_infos.at(&decl).assigned_outside;
+}
+
+bool FrameAnalysis::lives_in_frame(const VarDecl &decl) const {
+  auto info = var_infos.find(&decl);
+  return info != var_infos.end() && info->second.frame_position >= 0;
+}
+
+int FrameAnalysis::get_frame_position(const VarDecl &decl) const {
+  return var_infos.at(&decl).frame_position;
+}
+
+const std::vector<const VarDecl *> &
+FrameAnalysis::get_frame(const FunDecl &decl) const {
+  return fun_infos.at(&decl).frame;
+}
+
+const FunDecl &FrameAnalysis::get_owner(const VarDecl &decl) const {
+  return *var_infos.at(&decl).owner;
+}
+
+bool FrameAnalysis::is_tail_call(const FunCall &call) const {
+  return tail_calls.count(&call);
+}
+
+void FrameAnalysis::mark_tail_calls(const Expr &expr) {
+  if (auto call = dynamic_cast<const FunCall *>(&expr)) {
+    if (!call->get_decl().get().is_external)
+      tail_calls.insert(call);
+  } else if (auto seq = dynamic_cast<const Sequence *>(&expr)) {
+    if (!seq->get_exprs().empty())
+      mark_tail_calls(*seq->get_exprs().back());
+  } else if (auto let = dynamic_cast<const Let *>(&expr)) {
+    mark_tail_calls(let->get_sequence());
+  } else if (auto ite = dynamic_cast<const IfThenElse *>(&expr)) {
+    mark_tail_calls(ite->get_then_part());
+    mark_tail_calls(ite->get_else_part());
+  }
+}
+
+void FrameAnalysis::print_stats(std::ostream &ostream) const {
+  unsigned escaping = 0, framed = 0, by_reference = 0;
+  for (auto fun : functions)
+    for (auto var : fun->get_escaping_decls()) {
+      if (var->get_type() == t_void)
+        continue;
+      escaping++;
+      if (lives_in_frame(*var))
+        framed++;
+      else if (is_captured_by_reference(*var))
+        by_reference++;
+    }
+  ostream << "escaping variables: " << escaping << "\n"
+          << "  in frames: " << framed << "\n"
+          << "  captured by address: " << by_reference << "\n"
+          << "  no longer escaping: " << escaping - framed - by_reference
+          << "\n";
+}
+
+void FrameAnalysis::visit(const IntegerLiteral &) {}
+
+void FrameAnalysis::visit(const StringLiteral &) {}
+
+void FrameAnalysis::visit(const BinaryOperator &op) {
+  op.get_left().accept(*this);
+  op.get_right().accept(*this);
+}
+
+void FrameAnalysis::visit(const Sequence &seq) {
+  for (auto expr : seq.get_exprs())
+    expr->accept(*this);
+}
+
+void FrameAnalysis::visit(const Let &let) {
+  for (auto decl : let.get_decls())
+    decl->accept(*this);
+  let.get_sequence().accept(*this);
+}
+
+void FrameAnalysis::visit(const Identifier &id) {
+  // Void variables have no storage and are never captured.
+  if (id.get_type() != t_void)
+    fun_infos[current_function].uses.insert(&id.get_decl().get());
+}
+
+void FrameAnalysis::visit(const IfThenElse &ite) {
+  ite.get_condition().accept(*this);
+  ite.get_then_part().accept(*this);
+  ite.get_else_part().accept(*this);
+}
+
+void FrameAnalysis::visit(const VarDecl &decl) {
+  var_infos[&decl].owner = current_function;
+  fun_infos[current_function].decls.push_back(&decl);
+  if (decl.get_expr())
+    decl.get_expr()->accept(*this);
+}
+
+void FrameAnalysis::visit(const FunDecl &decl) {
+  if (!decl.get_expr())
+    return;
+
+  const FunDecl *const saved = current_function;
+  current_function = &decl;
+  functions.push_back(&decl);
+  FunInfo &info = fun_infos[&decl];
+  for (auto param : decl.get_params()) {
+    var_infos[param].owner = &decl;
+    info.decls.push_back(param);
+  }
+  decl.get_expr()->accept(*this);
+  mark_tail_calls(*decl.get_expr());
+  current_function = saved;
+}
+
+void FrameAnalysis::visit(const FunCall &call) {
+  const FunDecl &decl = call.get_decl().get();
+  if (!decl.is_external)
+    fun_infos[current_function].callees.insert(&decl);
+  for (auto arg : call.get_args())
+    arg->accept(*this);
+}
+
+void FrameAnalysis::visit(const WhileLoop &loop) {
+  loop.get_condition().accept(*this);
+  loop.get_body().accept(*this);
+}
+
+void FrameAnalysis::visit(const ForLoop &loop) {
+  loop.get_variable().accept(*this);
+  loop.get_high().accept(*this);
+  loop.get_body().accept(*this);
+}
+
+void FrameAnalysis::visit(const Break &) {}
+
+void FrameAnalysis::visit(const Assign &assign) {
+  assign.get_lhs().accept(*this);
+  assign.get_rhs().accept(*this);
+  const VarDecl &decl = assign.get_lhs().get_decl().get();
+  VarInfo &info = var_infos[&decl];
+  if (info.owner != current_function)
+    info.assigned_outside = true;
+}
+
+} // namespace irgen
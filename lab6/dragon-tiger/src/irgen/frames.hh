@@ -0,0 +1,177 @@
+#ifndef FRAMES_HH
+#define FRAMES_HH
+
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../ast/nodes.hh"
+
+namespace irgen {
+using namespace ast::types;
+
+// Nested functions capturing at most this many variables are lambda
+// lifted: instead of a static link, they receive the captured variables
+// as extra parameters.
+const unsigned max_lifted_captures = 4;
+
+// Analysis run before IR generation which decides, for every function,
+// how it reaches the variables of its enclosing functions.
+//
+// A lifted function takes no static link. Each captured variable is
+// passed either by value, or by address when a function other than its
+// owner assigns it. The owner cannot run while a function it called is
+// running, so a value copied at call time is always up to date for
+// variables only ever assigned by their owner. Other nested functions
+// walk the static links, receiving their parent frame when they need
+// to, so the variables they use must live in the frame of their owner.
+class FrameAnalysis : public ConstASTVisitor {
+  // Set of nodes which remembers the insertion order, so that the
+  // generated code does not depend on pointer values.
+  template <typename T> struct OrderedSet {
+    std::vector<const T *> elements;
+    std::unordered_set<const T *> index;
+    bool insert(const T *element) {
+      if (!index.insert(element).second)
+        return false;
+      elements.push_back(element);
+      return true;
+    }
+  };
+  typedef OrderedSet<VarDecl> VarSet;
+  typedef OrderedSet<FunDecl> FunSet;
+
+  struct FunInfo {
+    // Variables used directly by the function body.
+    VarSet uses;
+    // Variables of enclosing functions needed by this function, either
+    // to use them or to pass them to the lifted functions it calls.
+    VarSet captures;
+    // Non-primitive functions called from the body.
+    FunSet callees;
+    // Variables declared by the function, in declaration order.
+    std::vector<const VarDecl *> decls;
+    // Variables stored in the frame, in frame order.
+    std::vector<const VarDecl *> frame;
+    bool lifted = false;
+    // Functions the function may end up calling, directly or not.
+    std::unordered_set<const FunDecl *> reachable;
+    // Whether the function may end up calling itself.
+    bool recursive = false;
+    // Whether the function takes a static link.
+    bool static_link = false;
+    // Whether the frame keeps a copy of the static link.
+    bool link_slot = false;
+  };
+
+  struct VarInfo {
+    // Function declaring the variable.
+    const FunDecl *owner = nullptr;
+    // Whether a function other than its owner assigns it.
+    bool assigned_outside = false;
+    // Index in the owner frame, or -1 if the variable is not accessed
+    // through static links.
+    int frame_position = -1;
+  };
+
+  const FunDecl *current_function;
+
+  // Functions in the order they appear in the program.
+  std::vector<const FunDecl *> functions;
+
+  // Everything is keyed by node: the AST is shared with the prebuilt
+  // libast and cannot carry extra fields.
+  std::unordered_map<const FunDecl *, FunInfo> fun_infos;
+  std::unordered_map<const VarDecl *, VarInfo> var_infos;
+
+  // Calls whose result is directly returned by the calling function.
+  std::unordered_set<const FunCall *> tail_calls;
+
+  void mark_tail_calls(const Expr &expr);
+
+  void compute_captures();
+  void compute_lifting();
+  void compute_frames();
+  void compute_recursion();
+  void unlift_up_to(const FunDecl &from, const FunDecl &target, bool &changed);
+  void link_up_to(const FunDecl &from, const FunDecl &target, bool &changed);
+
+public:
+  FrameAnalysis();
+
+  // Analyze the whole program given its main function.
+  void analyze(const FunDecl &main);
+
+  // Return true if the function does not take a static link but receives
+  // its captured variables as parameters.
+  bool is_lifted(const FunDecl &decl) const;
+
+  // Return true if the function takes its parent frame as first argument,
+  // which non-lifted functions only do when they read through it.
+  bool has_static_link(const FunDecl &decl) const;
+
+  // Return true if the static link of the function must be stored in
+  // its frame, so that nested functions can walk further up.
+  bool has_link_slot(const FunDecl &decl) const;
+
+  // Return true if the function needs a frame at all, either to hold
+  // variables or its static link.
+  bool needs_frame(const FunDecl &decl) const;
+
+  // Return true if the function may call itself, directly or through
+  // other functions.
+  bool is_recursive(const FunDecl &decl) const;
+
+  // Return true if each function may end up calling the other one.
+  bool in_same_cycle(const FunDecl &a, const FunDecl &b) const;
+
+  // Variables passed as extra parameters to a lifted function.
+  const std::vector<const VarDecl *> &get_captures(const FunDecl &decl) const;
+
+  // Return true if a captured variable is passed by address to the
+  // lifted functions.
+  bool is_captured_by_reference(const VarDecl &decl) const;
+
+  // Return true if the variable must be stored in its owner frame.
+  bool lives_in_frame(const VarDecl &decl) const;
+
+  // Return the index of a variable living in its owner frame. Index 0
+  // holds the static link of functions having a link slot.
+  int get_frame_position(const VarDecl &decl) const;
+
+  // Variables stored in the frame of a function, in frame order.
+  const std::vector<const VarDecl *> &get_frame(const FunDecl &decl) const;
+
+  // Return the function declaring a variable.
+  const FunDecl &get_owner(const VarDecl &decl) const;
+
+  // Return true if the call is the last thing its function does: the
+  // body itself, or recursively the last expression of a sequence or
+  // let, or a branch of a conditional in tail position. Calls to
+  // primitives are never marked.
+  bool is_tail_call(const FunCall &call) const;
+
+  // Report how many of the variables marked as escaping by the Escaper
+  // still need to live in memory.
+  void print_stats(std::ostream &) const;
+
+  virtual void visit(const IntegerLiteral &);
+  virtual void visit(const StringLiteral &);
+  virtual void visit(const BinaryOperator &);
+  virtual void visit(const Sequence &);
+  virtual void visit(const Let &);
+  virtual void visit(const Identifier &);
+  virtual void visit(const IfThenElse &);
+  virtual void visit(const VarDecl &);
+  virtual void visit(const FunDecl &);
+  virtual void visit(const FunCall &);
+  virtual void visit(const WhileLoop &);
+  virtual void visit(const ForLoop &);
+  virtual void visit(const Break &);
+  virtual void visit(const Assign &);
+};
+
+} // namespace irgen
+
+#endif // FRAMES_HH
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>  // For exit
 #include <iostream> // For std::cerr
 #include "irgen.hh"
@@ -16,16 +17,33 @@ namespace {
 
 namespace irgen {
 
+namespace {
+
+// Return false if evaluating the expression cannot allocate a string,
+// and thus cannot trigger a garbage collection.
+bool may_allocate(const Expr *expr) {
+  return !dynamic_cast<const IntegerLiteral *>(expr) &&
+         !dynamic_cast<const StringLiteral *>(expr) &&
+         !dynamic_cast<const Identifier *>(expr);
+}
+
+} // namespace
+
 llvm::Value *IRGenerator::visit(const IntegerLiteral &literal) {
   return Builder.getInt32(literal.value);
 }
 
 llvm::Value *IRGenerator::visit(const StringLiteral &literal) {
-  return Builder.CreateGlobalStringPtr(literal.value.get());
+  return string_literal(literal.value);
 }
 
 llvm::Value *IRGenerator::visit(const Break &b) {
-  Builder.CreateBr(loop_exit_bbs[b.get_loop().get_ptr()]);
+  set_location(b);
+  Builder.CreateBr(loop_exit_bb(b.get_loop().get()));
+  // Whatever follows the break in the loop body is unreachable, but
+  // still needs a block to be generated in.
+  Builder.SetInsertPoint(
+      llvm::BasicBlock::Create(Context, "after_break", current_function));
   return nullptr;
 }
 
@@ -37,16 +55,23 @@ llvm::Value *IRGenerator::visit(const BinaryOperator &op) {
   }
 
   llvm::Value *l = op.get_left().accept(*this);
+  llvm::Value *const l_slot =
+      op.get_left().get_type() == t_string && may_allocate(&op.get_right())
+          ? protect_string(l)
+          : nullptr;
   llvm::Value *r = op.get_right().accept(*this);
+  if (l_slot)
+    l = Builder.CreateLoad(l_slot);
+  set_location(op);
 
   if (op.get_left().get_type() == t_string) {
-    auto const strcmp = Mod->getOrInsertFunction("__strcmp", Builder.getInt32Ty(),
-        Builder.getInt8PtrTy(), Builder.getInt8PtrTy()
-#if LLVM_VERSION_MAJOR < 5
-        , nullptr  // Older versions of LLVM uses C-vararg with a NULL end sigil
-#endif // LLVM_MAJOR_VERSION < 5
-        );
-    l = Builder.CreateCall(strcmp, {l, r});
+    if (op.op == o_eq || op.op == o_neq) {
+      llvm::Value *const equal = string_equality(l, r);
+      return Builder.CreateIntCast(
+          op.op == o_eq ? equal : Builder.CreateNot(equal),
+          Builder.getInt32Ty(), false);
+    }
+    l = Builder.CreateCall(string_comparison("__strcmp"), {l, r});
     r = Builder.getInt32(0);
   }
 
@@ -95,8 +120,8 @@ llvm::Value *IRGenerator::visit(const Identifier &id) {
   if(id.get_type() == t_void) {
     return nullptr;
   }
-  llvm::Value * varPtr = address_of(id); 
-  return (Builder.CreateLoad(varPtr));
+  set_location(id);
+  return load_variable(id.get_decl().get());
 }
 
 llvm::Value *IRGenerator::visit(const IfThenElse &ite) {
@@ -113,9 +138,10 @@ llvm::Value *IRGenerator::visit(const IfThenElse &ite) {
   llvm::BasicBlock *const end_block =
 	  llvm::BasicBlock::Create(Context, "if_end", current_function);
 
-  Builder.CreateCondBr(
-		  Builder.CreateIsNotNull(ite.get_condition().accept(*this)),
-		  then_block, else_block);
+  llvm::Value *const condition = ite.get_condition().accept(*this);
+  set_location(ite);
+  Builder.CreateCondBr(Builder.CreateIsNotNull(condition),
+                       then_block, else_block);
 
   Builder.SetInsertPoint(then_block);
   llvm::Value *const then_result =
@@ -152,22 +178,38 @@ llvm::Value *IRGenerator::visit(const VarDecl &decl) {
   if(decl.get_expr()->get_type() == t_void) {
     return nullptr;
   }
+  set_location(decl);
 
   llvm::Value * varPtr = generate_vardecl(decl);
 
   if(varValue) {
-    Builder.CreateStore(varValue , varPtr);
+    store_variable(decl, varValue);
   }
   return varPtr;
 }
 
 llvm::Value *IRGenerator::visit(const FunDecl &decl) {
+  declare_function(decl);
+
+  if (decl.get_expr())
+    pending_func_bodies.push_front(&decl);
+
+  return nullptr;
+}
+
+llvm::Function *IRGenerator::declare_function(const FunDecl &decl) {
   std::vector<llvm::Type *> param_types;
 
-  if(!decl.is_external) {
-    if(decl.get_parent()) {
-      param_types.push_back(frame_type[&decl.get_parent().get()]
-		      ->getPointerTo());
+  if(frames.has_static_link(decl)) {
+    param_types.push_back(frame_type[&decl.get_parent().get()]
+		    ->getPointerTo());
+  }
+  else if(frames.is_lifted(decl)) {
+    for (auto captured : frames.get_captures(decl)) {
+      llvm::Type *const type = llvm_type(captured->get_type());
+      param_types.push_back(frames.is_captured_by_reference(*captured)
+                                ? type->getPointerTo()
+                                : type);
     }
   }
   for (auto param_decl : decl.get_params()) {
@@ -179,46 +221,131 @@ llvm::Value *IRGenerator::visit(const FunDecl &decl) {
   llvm::FunctionType *ft =
       llvm::FunctionType::get(return_type, param_types, false);
 
-  llvm::Function::Create(ft,
-                         decl.is_external ? llvm::Function::ExternalLinkage
-                                          : llvm::Function::InternalLinkage,
-                         decl.get_external_name().get(), Mod.get());
-
-  if (decl.get_expr())
-    pending_func_bodies.push_front(&decl);
+  llvm::Function *const fun = llvm::Function::Create(
+      ft,
+      decl.is_external ? llvm::Function::ExternalLinkage
+                       : llvm::Function::InternalLinkage,
+      decl.get_external_name().get(), Mod.get());
+
+  // Tiger functions share the same convention, so that calls between
+  // them in tail position can be turned into jumps.
+  if (!decl.is_external && decl.get_parent())
+    fun->setCallingConv(llvm::CallingConv::Fast);
+
+  if (decl.is_external) {
+    set_primitive_attributes(fun);
+  } else {
+    // Tiger has no exceptions and the primitives never unwind.
+    fun->addFnAttr(llvm::Attribute::NoUnwind);
+    if (!frames.is_recursive(decl))
+      fun->addFnAttr(llvm::Attribute::NoRecurse);
+  }
 
-  return nullptr;
+  return fun;
 }
 
 llvm::Value *IRGenerator::visit(const FunCall &call) {
   // Look up the name in the global module table.
   const FunDecl &decl = call.get_decl().get();
+  set_location(call);
+  if (decl.is_external) {
+    if (llvm::Value *const value = inline_primitive(call))
+      return value;
+  }
+
   llvm::Function *callee =
       Mod->getFunction(decl.get_external_name().get());
 
   if (!callee) {
     // This should only happen for primitives whose Decl is out of the AST
-    // and has not yet been handled
-    assert(!decl.get_expr());
-    decl.accept(*this);
-    callee = Mod->getFunction(decl.get_external_name().get());
+    // and has not yet been handled. Those declared by the driver carry a
+    // placeholder body, which is never generated.
+    assert(decl.is_external);
+    callee = declare_function(decl);
+  }
+
+  // The arguments are evaluated first, so that variables captured by
+  // value are read at the time of the call. Strings are kept in root
+  // slots until the last argument which may allocate is evaluated.
+  const std::vector<Expr *> &args = call.get_args();
+  const auto last_allocating =
+      std::find_if(args.rbegin(), args.rend(), may_allocate).base();
+  std::vector<llvm::Value *> explicit_args;
+  std::vector<llvm::Value *> slots;
+  for (auto it = args.begin(); it != args.end(); ++it) {
+    llvm::Value *const value = (*it)->accept(*this);
+    const bool held =
+        (*it)->get_type() == t_string && it + 1 < last_allocating;
+    explicit_args.push_back(value);
+    slots.push_back(held ? protect_string(value) : nullptr);
   }
+  for (size_t i = 0; i < explicit_args.size(); i++)
+    if (slots[i])
+      explicit_args[i] = Builder.CreateLoad(slots[i]);
 
   std::vector<llvm::Value *> args_values;
 
-  if(!decl.is_external) {
-    args_values.push_back(frame_up(call.get_depth() - decl.get_depth()).second);
-  }
+  // A tail call releases the stack of the current function, so it
+  // cannot be given the address of the current frame or of a local
+  // variable.
+  bool tail = frames.is_tail_call(call) &&
+              decl.get_type() == current_function_decl->get_type();
 
-  for (auto expr : call.get_args()) {
-    args_values.push_back(expr->accept(*this));
+  if(frames.has_static_link(decl)) {
+    const int levels = call.get_depth() - decl.get_depth();
+    args_values.push_back(frame_up(levels).second);
+    tail &= levels > 0;
+  }
+  else if(frames.is_lifted(decl)) {
+    for (auto captured : frames.get_captures(decl)) {
+      if (frames.is_captured_by_reference(*captured)) {
+        args_values.push_back(address_of(*captured));
+        tail &= &frames.get_owner(*captured) != current_function_decl;
+      }
+      else {
+        args_values.push_back(load_variable(*captured));
+      }
+    }
   }
 
-  if (decl.get_type() == t_void) {
-    Builder.CreateCall(callee, args_values);
-    return nullptr;
+  args_values.insert(args_values.end(), explicit_args.begin(),
+                     explicit_args.end());
+  set_location(call);
+
+  llvm::CallInst *const result = Builder.CreateCall(
+      callee, args_values, decl.get_type() == t_void ? "" : "call");
+  result->setCallingConv(callee->getCallingConv());
+
+  if (tail) {
+    // Return right away so that the call stays in tail position. The
+    // code which would have carried the result to the end of the
+    // function is generated in an unreachable block. LLVM can only
+    // guarantee that the stack is reused, even without optimizations,
+    // when both functions have the same prototype. Calls which give the
+    // callee the frame of the current function are never tail calls.
+    result->setTailCallKind(
+        callee->getFunctionType() == current_function->getFunctionType() &&
+                callee->getCallingConv() ==
+                    current_function->getCallingConv()
+            ? llvm::CallInst::TCK_MustTail
+            : llvm::CallInst::TCK_Tail);
+    // Once inlined into a function with a frame, the call would be
+    // followed by the end of the frame lifetime. This only matters for
+    // calls within a recursive cycle, which must run in constant stack
+    // space, except self calls which are turned into loops before
+    // inlining.
+    if (&decl != current_function_decl &&
+        frames.in_same_cycle(*current_function_decl, decl))
+      current_function->addFnAttr(llvm::Attribute::NoInline);
+    if (decl.get_type() == t_void)
+      Builder.CreateRetVoid();
+    else
+      Builder.CreateRet(result);
+    Builder.SetInsertPoint(llvm::BasicBlock::Create(
+        Context, "after_tail_call", current_function));
   }
-  return Builder.CreateCall(callee, args_values, "call");
+
+  return decl.get_type() == t_void ? nullptr : result;
 }
 
 llvm::Value *IRGenerator::visit(const WhileLoop &loop) {
@@ -228,12 +355,14 @@ llvm::Value *IRGenerator::visit(const WhileLoop &loop) {
       llvm::BasicBlock::Create(Context, "loop_body", current_function);
   llvm::BasicBlock *const end_block =
       llvm::BasicBlock::Create(Context, "loop_end", current_function);
+  set_location(loop);
   Builder.CreateBr(test_block);
 
-  loop_exit_bbs[&loop] = end_block;
+  loop_exit_bbs.push_back(std::make_pair(&loop, end_block));
 
   Builder.SetInsertPoint(test_block);
   llvm::Value *const cond = loop.get_condition().accept(*this);
+  set_location(loop);
   Builder.CreateCondBr(Builder.CreateIsNotNull(cond),
                        body_block, end_block);
 
@@ -241,32 +370,56 @@ llvm::Value *IRGenerator::visit(const WhileLoop &loop) {
   loop.get_body().accept(*this);
   Builder.CreateBr(test_block);
 
+  loop_exit_bbs.pop_back();
   Builder.SetInsertPoint(end_block);
   return nullptr;
 }
 
 llvm::Value *IRGenerator::visit(const ForLoop &loop) {
-  llvm::BasicBlock *const test_block =
-      llvm::BasicBlock::Create(Context, "loop_test", current_function);
+  llvm::BasicBlock *const preheader_block =
+      llvm::BasicBlock::Create(Context, "loop_preheader", current_function);
   llvm::BasicBlock *const body_block =
       llvm::BasicBlock::Create(Context, "loop_body", current_function);
+  llvm::BasicBlock *const latch_block =
+      llvm::BasicBlock::Create(Context, "loop_latch", current_function);
   llvm::BasicBlock *const end_block =
       llvm::BasicBlock::Create(Context, "loop_end", current_function);
-  llvm::Value *const index = loop.get_variable().accept(*this);
+
+  const VarDecl &variable = loop.get_variable();
+  llvm::Value *const low = variable.get_expr()->accept(*this);
+  generate_vardecl(variable);
   llvm::Value *const high = loop.get_high().accept(*this);
-  Builder.CreateBr(test_block);
-  loop_exit_bbs[&loop] = end_block;
+  set_location(loop);
+  Builder.CreateCondBr(Builder.CreateICmpSLE(low, high),
+                       preheader_block, end_block);
 
-  Builder.SetInsertPoint(test_block);
-  Builder.CreateCondBr(Builder.CreateICmpSLE(Builder.CreateLoad(index), high),
-                       body_block, end_block);
+  Builder.SetInsertPoint(preheader_block);
+  Builder.CreateBr(body_block);
+  loop_exit_bbs.push_back(std::make_pair(&loop, end_block));
 
+  // The induction variable lives in a register. It is copied to the
+  // variable at the start of each iteration for the body to read it,
+  // which mem2reg removes unless the variable lives in a frame.
   Builder.SetInsertPoint(body_block);
+  llvm::PHINode *const value =
+      Builder.CreatePHI(Builder.getInt32Ty(), 2, variable.name.get());
+  value->addIncoming(low, preheader_block);
+  store_variable(variable, value);
   loop.get_body().accept(*this);
-  Builder.CreateStore(
-      Builder.CreateAdd(Builder.CreateLoad(index), Builder.getInt32(1)), index);
-  Builder.CreateBr(test_block);
-
+  Builder.CreateBr(latch_block);
+
+  // Leave after the iteration for high rather than when the index goes
+  // past it, so that the increment cannot overflow and the trip count
+  // is known on entry.
+  Builder.SetInsertPoint(latch_block);
+  set_location(loop);
+  value->addIncoming(Builder.CreateNSWAdd(value, Builder.getInt32(1), "next"),
+                     latch_block);
+  llvm::BranchInst *const latch = Builder.CreateCondBr(
+      Builder.CreateICmpEQ(value, high), end_block, body_block);
+  latch->setMetadata(llvm::LLVMContext::MD_loop, loop_hints());
+
+  loop_exit_bbs.pop_back();
   Builder.SetInsertPoint(end_block);
   return nullptr;
 }
@@ -278,9 +431,9 @@ llvm::Value *IRGenerator::visit(const Assign &assign) {
   if(assign.get_rhs().get_type() == t_void) {
     return nullptr;
   }
-  llvm::Value * assignPtr = address_of(assign.get_lhs()); 
-  Builder.CreateStore(assignValue, assignPtr);
-  return assignPtr;
+  set_location(assign);
+  store_variable(assign.get_lhs().get_decl().get(), assignValue);
+  return nullptr;
 }
 
 } // namespace irgen
@@ -1,15 +1,39 @@
 #include "irgen.hh"
 #include "../utils/errors.hh"
 
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
 
 using utils::error;
 
 namespace irgen {
 
-IRGenerator::IRGenerator() : Builder(Context) {
+IRGenerator::IRGenerator()
+    : Builder(Context), empty_heap_string(nullptr), debug_file(nullptr),
+      debug_function(nullptr) {
   Mod = llvm::make_unique<llvm::Module>("tiger", Context);
+  set_native_target();
+}
+
+void IRGenerator::enable_debug_info(const std::string &filename) {
+  DBuilder = llvm::make_unique<llvm::DIBuilder>(*Mod);
+  // The file name is kept as given, relative to the compilation
+  // directory.
+  llvm::SmallString<128> directory;
+  llvm::sys::fs::current_path(directory);
+  debug_file = DBuilder->createFile(filename, directory);
+  // DWARF has no language code for Tiger, C is the closest one.
+  DBuilder->createCompileUnit(llvm::dwarf::DW_LANG_C, debug_file, "dtiger",
+                              false, "", 0);
+  Mod->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                     llvm::DEBUG_METADATA_VERSION);
+  Mod->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
 }
 
 llvm::Type *IRGenerator::llvm_type(const ast::Type ast_type) {
@@ -25,6 +49,67 @@ llvm::Type *IRGenerator::llvm_type(const ast::Type ast_type) {
   }
 }
 
+llvm::DIType *IRGenerator::debug_type(const ast::Type ast_type) {
+  switch (ast_type) {
+  case t_int:
+    return DBuilder->createBasicType("int", 32, llvm::dwarf::DW_ATE_signed);
+  case t_string:
+    return DBuilder->createPointerType(
+        DBuilder->createBasicType("char", 8, llvm::dwarf::DW_ATE_signed_char),
+        Mod->getDataLayout().getPointerSizeInBits(), 0, llvm::None,
+        "string");
+  case t_void:
+    return nullptr;
+  default:
+    assert(false); __builtin_unreachable();
+  }
+}
+
+void IRGenerator::set_location(const Node &node) {
+  if (DBuilder)
+    Builder.SetCurrentDebugLocation(llvm::DILocation::get(
+        Context, node.loc.begin.line, node.loc.begin.column, debug_function));
+}
+
+void IRGenerator::declare_variable(const VarDecl &decl, llvm::Value *address,
+                                   unsigned arg_no) {
+  if (!DBuilder)
+    return;
+
+  const unsigned line = decl.loc.begin.line;
+  llvm::DIType *const type = debug_type(decl.get_type());
+  llvm::DILocalVariable *const variable =
+      arg_no ? DBuilder->createParameterVariable(debug_function,
+                                                 decl.name.get(), arg_no,
+                                                 debug_file, line, type)
+             : DBuilder->createAutoVariable(debug_function, decl.name.get(),
+                                            debug_file, line, type);
+
+  // Variables living in the frame of the current function are described
+  // as an offset in the frame alloca. A lifted function may also be given
+  // a variable living in the frame of its owner, which it keeps in a
+  // local shadow described as is.
+  llvm::DIExpression *expression = DBuilder->createExpression();
+  if (frames.lives_in_frame(decl) &&
+      &frames.get_owner(decl) == current_function_decl) {
+    const uint64_t offset =
+        Mod->getDataLayout()
+            .getStructLayout(frame_type[current_function_decl])
+            ->getElementOffset(frames.get_frame_position(decl));
+    address = frame;
+    if (offset)
+      expression = DBuilder->createExpression(
+          llvm::SmallVector<uint64_t, 2>{llvm::dwarf::DW_OP_plus_uconst,
+                                         offset});
+  }
+
+  DBuilder->insertDeclare(
+      address, variable, expression,
+      llvm::DILocation::get(Context, line, decl.loc.begin.column,
+                            debug_function),
+      &current_function->getEntryBlock());
+}
+
 llvm::Value *IRGenerator::alloca_in_entry(llvm::Type *Ty,
                                           const std::string &name) {
   llvm::IRBuilderBase::InsertPoint const saved = Builder.saveIP();
@@ -34,6 +119,97 @@ llvm::Value *IRGenerator::alloca_in_entry(llvm::Type *Ty,
   return value;
 }
 
+llvm::Value *IRGenerator::alloca_gc_root(const std::string &name) {
+  llvm::Value *const slot = alloca_in_entry(Builder.getInt8PtrTy(), name);
+  gc_roots.push_back(slot);
+  return slot;
+}
+
+llvm::Value *IRGenerator::protect_string(llvm::Value *string) {
+  llvm::Value *const slot = alloca_gc_root("protected");
+  Builder.CreateStore(string, slot);
+  return slot;
+}
+
+void IRGenerator::generate_gc_frame() {
+  llvm::BasicBlock &entry = current_function->getEntryBlock();
+  Builder.SetInsertPoint(&entry);
+
+  std::vector<llvm::Value *> roots = gc_roots;
+  for (auto var : frames.get_frame(*current_function_decl))
+    if (var->get_type() == t_string)
+      roots.push_back(Builder.CreateStructGEP(
+          frame_type[current_function_decl], frame,
+          frames.get_frame_position(*var)));
+  if (roots.empty())
+    return;
+
+  // Same layout as struct gc_frame in runtime/posix/runtime.h. The
+  // slots are cleared first, as a collection may happen before they
+  // are all assigned.
+  llvm::Type *const string = Builder.getInt8PtrTy();
+  llvm::StructType *const type = llvm::StructType::get(
+      Context, {string, Builder.getInt32Ty(),
+                llvm::ArrayType::get(string->getPointerTo(), roots.size())});
+  llvm::Value *const gc_frame = Builder.CreateAlloca(type, nullptr, "gc_frame");
+  for (size_t i = 0; i < roots.size(); i++) {
+    Builder.CreateStore(llvm::ConstantPointerNull::get(
+                            llvm::cast<llvm::PointerType>(string)),
+                        roots[i]);
+    Builder.CreateStore(roots[i],
+                        Builder.CreateInBoundsGEP(
+                            type, gc_frame,
+                            {Builder.getInt32(0), Builder.getInt32(2),
+                             Builder.getInt32(i)}));
+  }
+  Builder.CreateStore(Builder.getInt32(roots.size()),
+                      Builder.CreateStructGEP(type, gc_frame, 1));
+
+  llvm::Constant *const chain = Mod->getOrInsertGlobal("__gc_roots", string);
+  llvm::Value *const prev = Builder.CreateLoad(chain, "gc_prev");
+  Builder.CreateStore(prev, Builder.CreateStructGEP(type, gc_frame, 0));
+  Builder.CreateStore(Builder.CreatePointerCast(gc_frame, string), chain);
+
+  // Calls in tail position reuse the stack of the function, which must
+  // be left before them.
+  for (auto &bb : *current_function)
+    if (auto ret = llvm::dyn_cast_or_null<llvm::ReturnInst>(
+            bb.getTerminator())) {
+      llvm::Instruction *exit = ret;
+      if (auto call = llvm::dyn_cast_or_null<llvm::CallInst>(
+              ret->getPrevNode()))
+        if (call->isTailCall())
+          exit = call;
+      Builder.SetInsertPoint(exit);
+      Builder.CreateStore(prev, chain);
+    }
+}
+
+void IRGenerator::link_runtime(const std::string &filename) {
+  llvm::SMDiagnostic diagnostic;
+  std::unique_ptr<llvm::Module> runtime =
+      llvm::parseIRFile(filename, diagnostic, Context);
+  if (!runtime)
+    error("cannot load runtime " + filename + ": " +
+          diagnostic.getMessage().str());
+
+  // Once linked, the primitives are private to the program: they can be
+  // dropped after inlining and do not clash with libruntime.a.
+  std::vector<std::string> primitives;
+  for (auto &fun : *runtime)
+    if (!fun.isDeclaration())
+      primitives.push_back(fun.getName().str());
+
+  if (llvm::Linker::linkModules(*Mod, std::move(runtime),
+                                llvm::Linker::Flags::LinkOnlyNeeded))
+    error("cannot link runtime " + filename);
+
+  for (auto &name : primitives)
+    if (llvm::Function *fun = Mod->getFunction(name))
+      if (!fun->isDeclaration())
+        fun->setLinkage(llvm::GlobalValue::InternalLinkage);
+}
+
 void IRGenerator::print_ir(std::ostream *ostream) {
   // FIXME: This is inefficient. Should probably take a filename
   // and use directly LLVM raw stream interface
@@ -44,45 +220,400 @@ void IRGenerator::print_ir(std::ostream *ostream) {
   *ostream << buffer;
 }
 
+void IRGenerator::print_escape_stats(std::ostream *ostream) {
+  frames.print_stats(*ostream);
+}
+
 llvm::Value *IRGenerator::address_of(const Identifier &id) {
   assert(id.get_decl());
-  const VarDecl &decl = dynamic_cast<const VarDecl &>(id.get_decl().get());
-  if(decl.get_escapes()) {
-    std::pair<llvm::StructType *, llvm::Value *> myFrame = 
-	    frame_up(id.get_depth() - decl.get_depth());
-    return (Builder.CreateStructGEP(myFrame.first, myFrame.second, 
-			    frame_position[&decl]));
+  return address_of(id.get_decl().get());
+}
+
+llvm::Value *IRGenerator::address_of(const VarDecl &decl) {
+  auto const local = allocations.find(&decl);
+  if (local != allocations.end())
+    return local->second;
+
+  // The variable belongs to an enclosing function, reach its frame
+  // through the static links.
+  const FunDecl &owner = frames.get_owner(decl);
+  int levels = 0;
+  for (const FunDecl *fun = current_function_decl; fun != &owner;
+       fun = &fun->get_parent().get())
+    levels++;
+  std::pair<llvm::StructType *, llvm::Value *> myFrame = frame_up(levels);
+  return Builder.CreateStructGEP(myFrame.first, myFrame.second,
+                                 frames.get_frame_position(decl));
+}
+
+llvm::Constant *IRGenerator::string_literal(const Symbol &value) {
+  llvm::Constant *&literal = string_literals[value];
+  if (!literal) {
+    const std::string &chars = value.get();
+    const llvm::DataLayout &layout = Mod->getDataLayout();
+    if (chars.size() < layout.getPointerSize()) {
+      // Encoded as the runtime does: the length and the tag in the
+      // lowest byte, then the characters.
+      uint64_t bits = chars.size() << 1 | 1;
+      for (size_t i = 0; i < chars.size(); i++)
+        bits |= uint64_t(uint8_t(chars[i])) << 8 * (i + 1);
+      literal = llvm::ConstantExpr::getIntToPtr(
+          llvm::ConstantInt::get(layout.getIntPtrType(Context), bits),
+          Builder.getInt8PtrTy());
+    } else {
+      literal = heap_string(chars);
+    }
   }
-  else {
-    return allocations[&decl];
+  return literal;
+}
+
+llvm::Constant *IRGenerator::heap_string(const std::string &value) {
+  // Same layout as the runtime strings: the flags and the length are
+  // stored right before the NUL-terminated characters.
+  llvm::Constant *const chars =
+      llvm::ConstantDataArray::getString(Context, value);
+  llvm::Constant *const string = llvm::ConstantStruct::getAnon(
+      {Builder.getInt32(0), Builder.getInt32(value.size()), chars});
+  llvm::GlobalVariable *const global = new llvm::GlobalVariable(
+      *Mod, string->getType(), true, llvm::GlobalValue::PrivateLinkage,
+      string, "str");
+  global->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+  global->setAlignment(4);
+  llvm::Constant *const zero = Builder.getInt32(0);
+  return llvm::ConstantExpr::getInBoundsGetElementPtr(
+      string->getType(), global,
+      llvm::ArrayRef<llvm::Constant *>{zero, Builder.getInt32(2), zero});
+}
+
+llvm::Value *IRGenerator::is_small_string(llvm::Value *string) {
+  return Builder.CreateTrunc(
+      Builder.CreatePtrToInt(string,
+                             Mod->getDataLayout().getIntPtrType(Context)),
+      Builder.getInt1Ty(), "small");
+}
+
+llvm::Value *IRGenerator::string_address(llvm::Value *string) {
+  if (!empty_heap_string)
+    empty_heap_string = heap_string("");
+  return Builder.CreateSelect(is_small_string(string), empty_heap_string,
+                              string, "address");
+}
+
+llvm::Value *IRGenerator::string_length(llvm::Value *string) {
+  // Reading the header of the empty string rather than branching lets
+  // LLVM turn this into a few instructions.
+  llvm::Value *const heap_length =
+      heap_string_length(string_address(string));
+  llvm::Value *const small_length = Builder.CreateZExt(
+      Builder.CreateLShr(
+          Builder.CreateTrunc(
+              Builder.CreatePtrToInt(
+                  string, Mod->getDataLayout().getIntPtrType(Context)),
+              Builder.getInt8Ty()),
+          1),
+      Builder.getInt32Ty());
+  return Builder.CreateSelect(is_small_string(string), small_length,
+                              heap_length, "length");
+}
+
+llvm::Value *IRGenerator::heap_string_length(llvm::Value *string) {
+  // The length is the 32 bits integer stored right before the
+  // characters, as in runtime/posix/runtime.h.
+  llvm::Value *const header =
+      Builder.CreateInBoundsGEP(Builder.getInt8Ty(), string,
+                                Builder.getInt32(-4), "header");
+  llvm::LoadInst *const length = Builder.CreateLoad(
+      Builder.CreateBitCast(header, Builder.getInt32Ty()->getPointerTo()),
+      "length");
+  length->setAlignment(4);
+  length->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_tag("string length"));
+  return length;
+}
+
+void IRGenerator::set_primitive_attributes(llvm::Function *fun) {
+  // The runtime is written in C and never unwinds, fatal errors exit
+  // the program.
+  fun->addFnAttr(llvm::Attribute::NoUnwind);
+
+  const std::string name = fun->getName().str();
+  if (name == "__exit") {
+    fun->addFnAttr(llvm::Attribute::NoReturn);
+    return;
   }
+
+  if (name == "__not") {
+    fun->addFnAttr(llvm::Attribute::ReadNone);
+  } else if (name == "__size" || name == "__ord") {
+    fun->addFnAttr(llvm::Attribute::ReadOnly);
+    fun->addFnAttr(llvm::Attribute::ArgMemOnly);
+  } else if (name == "__strcmp" || name == "__streq") {
+    // Comparisons walk the children of ropes, which are not pointed to
+    // by the arguments, but write nothing.
+    fun->addFnAttr(llvm::Attribute::ReadOnly);
+  } else if (name == "__print" || name == "__print_err") {
+    // They flatten the ropes they are given, writing their children and
+    // allocating the flat copy, which never runs the collector. Besides
+    // that, they only touch the standard streams.
+    fun->addFnAttr(llvm::Attribute::InaccessibleMemOrArgMemOnly);
+  } else if (name == "__print_int" || name == "__flush" ||
+             name == "__getchar" || name == "__chr") {
+    // Strings of at most one character are preallocated by the runtime.
+    fun->addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+  } else if (name == "__substring" || name == "__concat" ||
+             name == "__read_line" || name == "__read_all") {
+    // Allocating a string may run the garbage collector, which reads
+    // the string slots of every active function.
+  } else {
+    return;
+  }
+
+  // Strings are never null, and the runtime keeps no reference to
+  // them, except for the ropes built by concat and the views built by
+  // substring. It only reads them, except when flattening a rope, which
+  // the generated code does not see as it only reads the length and the
+  // first character.
+  const bool captures = name == "__concat" || name == "__substring";
+  const bool flattens = name == "__print" || name == "__print_err";
+  for (auto &arg : fun->args())
+    if (arg.getType()->isPointerTy()) {
+      arg.addAttr(llvm::Attribute::NonNull);
+      if (!captures)
+        arg.addAttr(llvm::Attribute::NoCapture);
+      if (!flattens)
+        arg.addAttr(llvm::Attribute::ReadOnly);
+    }
+  if (fun->getReturnType()->isPointerTy())
+    fun->addAttribute(llvm::AttributeList::ReturnIndex,
+                      llvm::Attribute::NonNull);
+}
+
+llvm::Function *IRGenerator::string_comparison(const std::string &name) {
+  llvm::Function *fun = Mod->getFunction(name);
+  if (!fun) {
+    llvm::Type *const string = Builder.getInt8PtrTy();
+    fun = llvm::Function::Create(
+        llvm::FunctionType::get(Builder.getInt32Ty(), {string, string}, false),
+        llvm::Function::ExternalLinkage, name, Mod.get());
+    set_primitive_attributes(fun);
+  }
+  return fun;
+}
+
+llvm::Value *IRGenerator::string_equality(llvm::Value *l, llvm::Value *r) {
+  llvm::BasicBlock *const entry_block = Builder.GetInsertBlock();
+  llvm::BasicBlock *const small_block =
+      llvm::BasicBlock::Create(Context, "streq_small", current_function);
+  llvm::BasicBlock *const length_block =
+      llvm::BasicBlock::Create(Context, "streq_length", current_function);
+  llvm::BasicBlock *const chars_block =
+      llvm::BasicBlock::Create(Context, "streq_chars", current_function);
+  llvm::BasicBlock *const call_block =
+      llvm::BasicBlock::Create(Context, "streq_call", current_function);
+  llvm::BasicBlock *const end_block =
+      llvm::BasicBlock::Create(Context, "streq_end", current_function);
+
+  Builder.CreateCondBr(Builder.CreateICmpEQ(l, r), end_block, small_block);
+
+  // Every string short enough to be small is small, so different small
+  // strings are never equal, nor to strings laid out in memory.
+  Builder.SetInsertPoint(small_block);
+  Builder.CreateCondBr(
+      Builder.CreateOr(is_small_string(l), is_small_string(r)), end_block,
+      length_block);
+
+  Builder.SetInsertPoint(length_block);
+  Builder.CreateCondBr(
+      Builder.CreateICmpEQ(heap_string_length(l), heap_string_length(r)),
+      chars_block, end_block);
+
+  // Strings are NUL-terminated, so the first byte is always there.
+  Builder.SetInsertPoint(chars_block);
+  llvm::LoadInst *const l_first = Builder.CreateLoad(l);
+  llvm::LoadInst *const r_first = Builder.CreateLoad(r);
+  l_first->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_tag("char"));
+  r_first->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_tag("char"));
+  Builder.CreateCondBr(Builder.CreateICmpEQ(l_first, r_first), call_block,
+                       end_block);
+
+  Builder.SetInsertPoint(call_block);
+  llvm::Value *const equal = Builder.CreateIsNotNull(
+      Builder.CreateCall(string_comparison("__streq"), {l, r}));
+  Builder.CreateBr(end_block);
+
+  Builder.SetInsertPoint(end_block);
+  llvm::PHINode *const result = Builder.CreatePHI(Builder.getInt1Ty(), 5);
+  result->addIncoming(Builder.getTrue(), entry_block);
+  result->addIncoming(Builder.getFalse(), small_block);
+  result->addIncoming(Builder.getFalse(), length_block);
+  result->addIncoming(Builder.getFalse(), chars_block);
+  result->addIncoming(equal, call_block);
+  return result;
+}
+
+llvm::Value *IRGenerator::inline_primitive(const FunCall &call) {
+  const std::string &name = call.get_decl().get().get_external_name().get();
+  const std::vector<Expr *> &args = call.get_args();
+
+  if (name == "__not") {
+    llvm::Value *const value = args[0]->accept(*this);
+    return Builder.CreateZExt(Builder.CreateIsNull(value),
+                              Builder.getInt32Ty(), "not");
+  }
+
+  if (name == "__size")
+    return string_length(args[0]->accept(*this));
+
+  if (name == "__ord") {
+    // The characters are NUL-terminated, so the first byte can be read
+    // even for the empty string. That of a small string is its second
+    // lowest byte.
+    llvm::Value *const string = args[0]->accept(*this);
+    llvm::LoadInst *const heap_first =
+        Builder.CreateLoad(string_address(string), "first");
+    heap_first->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_tag("char"));
+    llvm::Value *const small_first = Builder.CreateTrunc(
+        Builder.CreateLShr(
+            Builder.CreatePtrToInt(
+                string, Mod->getDataLayout().getIntPtrType(Context)),
+            8),
+        Builder.getInt8Ty());
+    llvm::Value *const first = Builder.CreateSelect(
+        is_small_string(string), small_first, heap_first);
+    return Builder.CreateSelect(
+        Builder.CreateIsNull(string_length(string)),
+        Builder.getInt32(-1), Builder.CreateZExt(first, Builder.getInt32Ty()),
+        "ord");
+  }
+
+  return nullptr;
+}
+
+llvm::MDNode *IRGenerator::loop_hints() {
+  // The first operand of a loop identifier is the node itself, which
+  // keeps it distinct from the identifiers of the other loops.
+  //
+  // The vectorizer already looks at every loop. Forcing it with
+  // llvm.loop.vectorize.enable only makes opt warn about the loops its
+  // cost model rejects. Likewise, llvm.loop.unroll.enable also forces
+  // the full unrolling of loops with a known trip count, which opt
+  // reports as failures and which blows up on nested loops. Only ask for
+  // the remainder loop needed to unroll loops of unknown trip count.
+  llvm::Metadata *const hints[] = {
+      nullptr,
+      llvm::MDNode::get(
+          Context,
+          llvm::MDString::get(Context, "llvm.loop.unroll.runtime.enable")),
+  };
+  llvm::MDNode *const node = llvm::MDNode::getDistinct(Context, hints);
+  node->replaceOperandWith(0, node);
+  return node;
+}
+
+llvm::MDNode *IRGenerator::tbaa_scalar(const std::string &name) {
+  // Metadata nodes are uniqued, building them again is enough to find
+  // them back.
+  llvm::MDBuilder MDB(Context);
+  return MDB.createTBAAScalarTypeNode(name,
+                                      MDB.createTBAARoot("Tiger TBAA"));
+}
+
+llvm::MDNode *IRGenerator::tbaa_tag(const std::string &name) {
+  llvm::MDNode *const type = tbaa_scalar(name);
+  return llvm::MDBuilder(Context).createTBAAStructTagNode(type, type, 0);
+}
+
+llvm::MDNode *IRGenerator::tbaa_variable(const VarDecl &decl) {
+  const std::string type = decl.get_type() == t_int ? "int" : "string";
+
+  // Captured variables given to a lifted function may come from a frame
+  // as well as from a local alloca, so they are only known by their
+  // type.
+  const FunDecl &owner = frames.get_owner(decl);
+  if (!frames.lives_in_frame(decl) ||
+      (&owner != current_function_decl && allocations.count(&decl)))
+    return tbaa_tag(type);
+
+  const llvm::StructLayout *const layout =
+      Mod->getDataLayout().getStructLayout(frame_type[&owner]);
+  const uint64_t offset =
+      layout->getElementOffset(frames.get_frame_position(decl));
+  return llvm::MDBuilder(Context).createTBAAStructTagNode(
+      tbaa_frame[&owner], tbaa_scalar(type), offset);
+}
+
+llvm::MDNode *IRGenerator::tbaa_link(const FunDecl &decl) {
+  return llvm::MDBuilder(Context).createTBAAStructTagNode(
+      tbaa_frame[&decl], tbaa_scalar("static link"), 0);
+}
+
+llvm::LoadInst *IRGenerator::load_variable(const VarDecl &decl) {
+  llvm::LoadInst *const load = Builder.CreateLoad(address_of(decl));
+  load->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_variable(decl));
+  return load;
+}
+
+void IRGenerator::store_variable(const VarDecl &decl, llvm::Value *value) {
+  llvm::StoreInst *const store = Builder.CreateStore(value, address_of(decl));
+  store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_variable(decl));
+}
+
+llvm::BasicBlock *IRGenerator::loop_exit_bb(const Loop &loop) {
+  // Breaks nearly always leave the innermost loop.
+  for (auto it = loop_exit_bbs.rbegin(); it != loop_exit_bbs.rend(); ++it)
+    if (it->first == &loop)
+      return it->second;
+  assert(false); __builtin_unreachable();
 }
 
 void IRGenerator::generate_program(FunDecl *main) {
+  frames.analyze(*main);
   main->accept(*this);
 
   while (!pending_func_bodies.empty()) {
     generate_function(*pending_func_bodies.back());
     pending_func_bodies.pop_back();
   }
+
+  if (DBuilder)
+    DBuilder->finalize();
 }
 
 void IRGenerator::generate_function(const FunDecl &decl) {
   // Reinitialize common structures.
   allocations.clear();
   loop_exit_bbs.clear();
+  display.clear();
+  gc_roots.clear();
 
   // Set current function
   current_function = Mod->getFunction(decl.get_external_name().get());
   current_function_decl = &decl;
   std::vector<VarDecl *> params = decl.get_params();
 
+  if (DBuilder) {
+    std::vector<llvm::Metadata *> types{debug_type(decl.get_type())};
+    for (auto param : params)
+      types.push_back(debug_type(param->get_type()));
+    const unsigned line = decl.loc.begin.line;
+    debug_function = DBuilder->createFunction(
+        debug_file, decl.name.get(), decl.get_external_name().get(),
+        debug_file, line,
+        DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(types)),
+        line, llvm::DINode::FlagZero,
+        decl.get_parent() ? llvm::DISubprogram::SPFlagDefinition |
+                                llvm::DISubprogram::SPFlagLocalToUnit
+                          : llvm::DISubprogram::SPFlagDefinition);
+    current_function->setSubprogram(debug_function);
+  }
+  set_location(decl);
+
   // Create a new basic block to insert allocation insertion
   llvm::BasicBlock *bb1 =
       llvm::BasicBlock::Create(Context, "entry", current_function);
 
   Builder.SetInsertPoint(bb1);
   generate_frame();
+  display.push_back(frame);
 
   // Create a second basic block for body insertion
   llvm::BasicBlock *bb2 =
@@ -92,26 +623,48 @@ void IRGenerator::generate_function(const FunDecl &decl) {
 
   // Set the name for each argument and register it in the allocations map
   // after storing it in an alloca.
-  unsigned i = 0;
-  bool entered = false;
-
-  for (auto &arg : current_function->args()) {
-    //llvm::Value *const shadow = alloca_in_entry(llvm_type(params[i]->get_type()), params[i]->name.get());
+  auto arg = current_function->arg_begin();
 
-    if(!decl.is_external && i == 0 && !entered) {
+  if (frames.has_static_link(decl)) {
+    if (frames.has_link_slot(decl)) {
       llvm::Value * struc = Builder.CreateStructGEP(
 		      frame_type[&decl], frame, 0);
-      Builder.CreateStore(&arg, struc);
-      entered = true;
+      Builder.CreateStore(&*arg, struc)
+          ->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_link(decl));
     }
-    else {
-      arg.setName(params[i]->name.get());
-      llvm::Value *const shadow = generate_vardecl(*params[i]);
-      Builder.CreateStore(&arg, shadow);
-      i++;
+    display.push_back(&*arg);
+    ++arg;
+  }
+  else if (frames.is_lifted(decl)) {
+    // Captured variables come first. Those passed by value get their
+    // own local copy, the others are used through their address.
+    for (auto captured : frames.get_captures(decl)) {
+      arg->setName(captured->name.get());
+      if (frames.is_captured_by_reference(*captured)) {
+        allocations[captured] = &*arg;
+      }
+      else {
+        llvm::Value *const shadow =
+            captured->get_type() == t_string
+                ? alloca_gc_root(captured->name)
+                : alloca_in_entry(llvm_type(captured->get_type()),
+                                  captured->name);
+        allocations[captured] = shadow;
+        store_variable(*captured, &*arg);
+        declare_variable(*captured, shadow);
+      }
+      ++arg;
     }
   }
 
+  for (unsigned arg_no = 1; arg_no <= params.size(); arg_no++) {
+    const VarDecl *const param = params[arg_no - 1];
+    arg->setName(param->name.get());
+    generate_vardecl(*param, arg_no);
+    store_variable(*param, &*arg);
+    ++arg;
+  }
+
   // Visit the body
   llvm::Value *expr = decl.get_expr()->accept(*this);
 
@@ -121,6 +674,8 @@ void IRGenerator::generate_function(const FunDecl &decl) {
   else
     Builder.CreateRet(expr);
 
+  generate_gc_frame();
+
   // Jump from entry to body
   Builder.SetInsertPoint(bb1);
   Builder.CreateBr(bb2);
@@ -131,67 +686,89 @@ void IRGenerator::generate_function(const FunDecl &decl) {
 
 void IRGenerator::generate_frame() {
   std::vector<llvm::Type *> types;
-  if(current_function_decl->get_parent()) {
+  if(frames.has_link_slot(*current_function_decl)) {
     types.push_back(frame_type[
 	&current_function_decl->get_parent().get()]->getPointerTo());
   }
-  for (auto escp_decl : current_function_decl->get_escaping_decls()) {
-    if(escp_decl->get_type() != t_void) {
-      types.push_back(llvm_type(escp_decl->get_type()));
-    }
+  for (auto escp_decl : frames.get_frame(*current_function_decl)) {
+    types.push_back(llvm_type(escp_decl->get_type()));
   }
 
   llvm::StructType * myStruct = llvm::StructType::create(Context, types, "ft_" + 
 	  current_function_decl->get_external_name().get());
   frame_type[current_function_decl] = myStruct;
 
+  // No function takes an empty frame as static link.
+  if (!frames.needs_frame(*current_function_decl)) {
+    frame = llvm::ConstantPointerNull::get(myStruct->getPointerTo());
+    return;
+  }
+
+  // Frames are told apart by their name, each slot is described by
+  // its offset and the type of what it holds.
+  const llvm::StructLayout *const layout =
+      Mod->getDataLayout().getStructLayout(myStruct);
+  std::vector<std::pair<llvm::MDNode *, uint64_t>> fields;
+  if (frames.has_link_slot(*current_function_decl))
+    fields.emplace_back(tbaa_scalar("static link"), 0);
+  for (auto escp_decl : frames.get_frame(*current_function_decl))
+    fields.emplace_back(
+        tbaa_scalar(escp_decl->get_type() == t_int ? "int" : "string"),
+        layout->getElementOffset(frames.get_frame_position(*escp_decl)));
+  tbaa_frame[current_function_decl] = llvm::MDBuilder(Context)
+      .createTBAAStructTypeNode(myStruct->getName(), fields);
+
   frame = Builder.CreateAlloca(myStruct, nullptr, 
 		  "ft" + current_function_decl->get_external_name().get());
 }
 
 std::pair<llvm::StructType *, llvm::Value *> IRGenerator::frame_up(int levels) {
-  const FunDecl * fun = current_function_decl;
-  llvm::Value * sl = frame;
-  int current_level = levels;
-  while(current_level > 0) {
-    sl = Builder.CreateLoad(Builder.CreateStructGEP(frame_type[fun], sl, 0)); 
+  const FunDecl *fun = current_function_decl;
+  for (int i = 0; i < levels; i++)
     fun = &fun->get_parent().get();
-    current_level = current_level - 1;
+
+  // Complete the display up to the requested level. The loads are
+  // emitted at the end of the entry block, which dominates every use.
+  if (display.size() <= static_cast<size_t>(levels)) {
+    llvm::IRBuilderBase::InsertPoint const saved = Builder.saveIP();
+    Builder.SetInsertPoint(&current_function->getEntryBlock());
+    const FunDecl *up = current_function_decl;
+    for (size_t i = 1; i < display.size(); i++)
+      up = &up->get_parent().get();
+    while (display.size() <= static_cast<size_t>(levels)) {
+      llvm::Value *const link =
+          Builder.CreateStructGEP(frame_type[up], display.back(), 0);
+      llvm::LoadInst *const sl = Builder.CreateLoad(link, "sl");
+      sl->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_link(*up));
+      up = &up->get_parent().get();
+      display.push_back(sl);
+    }
+    Builder.restoreIP(saved);
   }
+
   std::pair<llvm::StructType *, llvm::Value *> myPair;
   myPair.first = frame_type[fun];
-  myPair.second = sl;
+  myPair.second = display[levels];
   return myPair;
 }
 
-llvm::Value *IRGenerator::generate_vardecl(const VarDecl &decl) {
-  if(decl.get_escapes()) {
-    int index = 0;
-    if(current_function_decl->get_parent()) {
-      index += 1;
-    }
-    for(size_t i = 0; i < (current_function_decl->get_escaping_decls()).size(); 
-		    i++) {
-
-      if(current_function_decl->get_escaping_decls()[i] == &decl) {
-	break;
-      }
-
-      if(current_function_decl->get_escaping_decls()[i]->get_type() != t_void) {
-        index += 1;
-      }
-
-    }
-    frame_position[&decl] = index;
+llvm::Value *IRGenerator::generate_vardecl(const VarDecl &decl,
+                                           unsigned arg_no) {
+  if(frames.lives_in_frame(decl)) {
+    int index = frames.get_frame_position(decl);
     llvm::Value * adr = Builder.CreateStructGEP(
 		    frame_type[current_function_decl], frame, index);
     allocations[&decl] = adr;
+    declare_variable(decl, adr, arg_no);
     return adr;
   }
   else {
     llvm::Type * varType = llvm_type(decl.get_type());
-    llvm::Value * varPtr = alloca_in_entry(varType, decl.name);
+    llvm::Value * varPtr = decl.get_type() == t_string
+                               ? alloca_gc_root(decl.name)
+                               : alloca_in_entry(varType, decl.name);
     allocations[&decl] = varPtr;
+    declare_variable(decl, varPtr, arg_no);
     return varPtr;
   }
 }
@@ -3,9 +3,12 @@
 
 #include <deque>
 #include <ostream>
+#include <unordered_map>
 
 #include "../ast/nodes.hh"
+#include "frames.hh"
 
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
@@ -24,19 +27,24 @@ class IRGenerator : public ConstASTValueVisitor {
   // Module generated by this tiger program compilation.
   std::unique_ptr<llvm::Module> Mod;
 
+  // Decides which functions are lambda lifted and which variables
+  // live in frames.
+  FrameAnalysis frames;
+
   // Current function being generated.
   llvm::Function *current_function;
   const FunDecl *current_function_decl;
 
   // Map variable declarations (including function parameters)
   // to LLVM values. Those values might refer to the current
-  // function frame if they are escaping, or to
-  // alloca-declared variables if they are not escaping.
-  std::map<const VarDecl *, llvm::Value *> allocations;
+  // function frame if they are escaping, to alloca-declared
+  // variables if they are not escaping, or to the variables
+  // captured by the current function if it is lifted.
+  std::unordered_map<const VarDecl *, llvm::Value *> allocations;
 
-  // Map loops to their exit blocks, so that early exits can
-  // be easily processed.
-  std::map<const Loop *, llvm::BasicBlock *> loop_exit_bbs;
+  // Exit blocks of the loops enclosing the current point, innermost
+  // last, so that early exits can be easily processed.
+  std::vector<std::pair<const Loop *, llvm::BasicBlock *>> loop_exit_bbs;
 
   // List of functions to be processed after the current one.
   // This is necessary because in Tiger we might encounter
@@ -46,22 +54,58 @@ class IRGenerator : public ConstASTValueVisitor {
   // generation before handling the next one.
   std::deque<const FunDecl *> pending_func_bodies;
 
-  // Map escaping variables to their position into the current
-  // function frame.
-  std::map<const VarDecl *, int> frame_position;
-
   // Map function declarations to their specific frame types.
-  std::map<const FunDecl *, llvm::StructType *> frame_type;
+  std::unordered_map<const FunDecl *, llvm::StructType *> frame_type;
+
+  // Map function declarations to the type-based alias analysis
+  // description of their frame.
+  std::unordered_map<const FunDecl *, llvm::MDNode *> tbaa_frame;
+
+  // String literals already emitted in this module, shared by all
+  // their uses.
+  std::unordered_map<Symbol, llvm::Constant *> string_literals;
+
+  // Empty string laid out in memory, read instead of small strings so
+  // that their header and first character can be loaded unconditionally.
+  llvm::Constant *empty_heap_string;
 
-  // Frame of the current function.
+  // Frame of the current function, or a null pointer if it needs none.
   llvm::Value *frame;
 
+  // String slots of the current function outside of its frame, which
+  // the garbage collector must scan: string variables and temporaries
+  // kept alive while other operands are evaluated.
+  std::vector<llvm::Value *> gc_roots;
+
+  // Builder for the debug information, only set when it has been
+  // requested. Debug locations are scoped by the subprogram of the
+  // current function.
+  std::unique_ptr<llvm::DIBuilder> DBuilder;
+  llvm::DIFile *debug_file;
+  llvm::DISubprogram *debug_function;
+
+  // Display of the current function: display[i] holds the frame of
+  // the enclosing function i levels up (display[0] is the current
+  // frame and display[1] the static link). Deeper entries are loaded
+  // once in the entry block the first time they are needed, so that
+  // accessing an outer variable does not walk the static links again.
+  std::vector<llvm::Value *> display;
+
   // Generate the LLVM IR code corresponding to a function
   // declaration. If inner function declarations are encountered,
   // they will be stored into pending_func_bodies for later
   // processing.
   void generate_function(const FunDecl &);
 
+  // Give the module the target of the host and its data layout, which
+  // decides among other things how long small strings may be. Called
+  // before any code is generated.
+  void set_native_target();
+
+  // Create the LLVM function of a function declaration, without its
+  // body.
+  llvm::Function *declare_function(const FunDecl &);
+
   // Return the LLVM type corresponding to a Tiger type.
   llvm::Type *llvm_type(const ast::Type);
 
@@ -70,8 +114,96 @@ class IRGenerator : public ConstASTValueVisitor {
   // otherwise automatic naming (%0, %1, etc.) will be used.
   llvm::Value *alloca_in_entry(llvm::Type *Ty, const std::string &name = "");
 
+  // Generate a new string slot in the entry block of the function,
+  // scanned by the garbage collector.
+  llvm::Value *alloca_gc_root(const std::string &name = "");
+
+  // Keep a string in a root slot while the next operands are evaluated,
+  // as they may allocate and trigger a collection. Return the slot to
+  // reload the string from.
+  llvm::Value *protect_string(llvm::Value *string);
+
+  // Push the string slots of the current function, including those of
+  // its frame, on the shadow stack of the garbage collector in the
+  // entry block, and pop them before returning. Must be called once
+  // the whole function has been generated.
+  void generate_gc_frame();
+
+  // Return the debug type corresponding to a Tiger type.
+  llvm::DIType *debug_type(const ast::Type);
+
+  // Attach the location of a node to the instructions generated from
+  // now on.
+  void set_location(const Node &node);
+
+  // Describe a variable stored at a given address to the debugger.
+  // Parameters are numbered from 1, 0 is used for other variables.
+  void declare_variable(const VarDecl &decl, llvm::Value *address,
+                        unsigned arg_no = 0);
+
+  // Return a string literal: a small string as described in
+  // runtime/posix/runtime.h if it is short enough, otherwise a pointer
+  // to its characters.
+  llvm::Constant *string_literal(const Symbol &value);
+
+  // Return a pointer to the characters of a string laid out in memory.
+  llvm::Constant *heap_string(const std::string &value);
+
+  // Return an i1 telling whether a string is small.
+  llvm::Value *is_small_string(llvm::Value *string);
+
+  // Return an address from which the header and the first character of
+  // a string can be read: the string itself, or an empty string laid out
+  // in memory if it is small.
+  llvm::Value *string_address(llvm::Value *string);
+
+  // Return the length of a string, read from its header unless it is
+  // small.
+  llvm::Value *string_length(llvm::Value *string);
+
+  // Return the length of a string which is not small.
+  llvm::Value *heap_string_length(llvm::Value *string);
+
+  // Tell LLVM what a runtime primitive may do, so that calls to it can
+  // be moved, merged or removed like any other instruction.
+  void set_primitive_attributes(llvm::Function *fun);
+
+  // Declare a runtime function comparing two strings.
+  llvm::Function *string_comparison(const std::string &name);
+
+  // Return an i1 telling whether two strings are equal. Identical
+  // pointers, small strings, different lengths or different first
+  // characters are checked inline before calling the runtime.
+  llvm::Value *string_equality(llvm::Value *l, llvm::Value *r);
+
+  // Generate inline code for a call to a primitive which is cheaper
+  // than the call itself. Return nullptr if the primitive has to be
+  // called.
+  llvm::Value *inline_primitive(const FunCall &call);
+
+  // Return a fresh llvm.loop node allowing the loop to be unrolled
+  // even when its trip count is only known at run time.
+  llvm::MDNode *loop_hints();
+
+  // Type-based alias analysis. Every frame is described as a struct of
+  // its own, so that LLVM knows that slots of different frames never
+  // overlap, and string headers and characters are given scalar types
+  // distinct from the variables.
+  llvm::MDNode *tbaa_scalar(const std::string &name);
+  llvm::MDNode *tbaa_tag(const std::string &name);
+  llvm::MDNode *tbaa_variable(const VarDecl &decl);
+  llvm::MDNode *tbaa_link(const FunDecl &decl);
+
+  // Read or write a variable, with its alias analysis tag.
+  llvm::LoadInst *load_variable(const VarDecl &decl);
+  void store_variable(const VarDecl &decl, llvm::Value *value);
+
+  // Return the exit block of an enclosing loop.
+  llvm::BasicBlock *loop_exit_bb(const Loop &loop);
+
   // Return the address of a given identifier.
   llvm::Value *address_of(const Identifier &id);
+  llvm::Value *address_of(const VarDecl &decl);
 
 public:
   // Constructor
@@ -81,14 +213,32 @@ public:
   // corresponding to the whole program.
   void generate_program(FunDecl *);
 
+  // Emit debug information referring to the given source file.
+  // Must be called before generate_program.
+  void enable_debug_info(const std::string &filename);
+
+  // Link the runtime, given as an LLVM bitcode or IR file, into the
+  // generated module so that its primitives can be inlined.
+  void link_runtime(const std::string &filename);
+
   // Print the generated IR.
   void print_ir(std::ostream *);
 
+  // Optimize the generated module and compile it into object files
+  // named prefix.0.o to prefix.<jobs - 1>.o. The module is optimized
+  // on the calling thread, then split in as many partitions, each one
+  // going through the code generator in its own thread. The module is
+  // consumed.
+  void emit_objects(const std::string &prefix, unsigned jobs);
+
+  // Print statistics about the variables kept out of frames.
+  void print_escape_stats(std::ostream *);
+
   // Creates the function frame
   void generate_frame();
 
   // Allocate variables inside decl
-  llvm::Value * generate_vardecl(const VarDecl &decl);
+  llvm::Value * generate_vardecl(const VarDecl &decl, unsigned arg_no = 0);
 
   // Finds the right frame
   std::pair<llvm::StructType *, llvm::Value *> frame_up(int levels);
@@ -0,0 +1,94 @@
+#! /bin/sh
+#
+# Check that the attributes given to the runtime primitives let opt
+# hoist size(s), ord(s) and string comparisons out of while loops.
+# Prints its results in the TAP format.
+
+DTIGER=${DTIGER:-../driver/dtiger}
+OPT=${OPT:-opt}
+
+tmp=$(mktemp)
+trap 'rm -f $tmp $tmp.loop' EXIT
+
+# Print the instructions of the blocks belonging to a loop of the
+# optimized module in $tmp, as found by the loop analysis of opt.
+loop_blocks() {
+  blocks=$($OPT -passes='print<loops>' -disable-output $tmp 2>&1 |
+           sed -n 's/^Loop at depth [0-9]* containing: //p' |
+           sed 's/<[a-z]*>//g; s/%//g; s/,/ /g')
+  for block in $blocks; do
+    # Unnamed blocks are labelled "; <label>:N:" before LLVM 10.
+    awk -v block="$block" '
+      /^$/ { inside = 0 }
+      $1 == block ":" || $2 == "<label>:" block ":" { inside = 1 }
+      inside' $tmp
+  done
+}
+
+echo "1..6"
+
+$DTIGER -i --dump-ir - <<EOF | $OPT -O3 -S -o $tmp -
+let var s := concat("hello, ", "world")
+    var i := 0
+in while i < size(s) do (
+     print_int(ord(s) + i);
+     i := i + 1)
+end
+EOF
+
+if grep -q '^define.*@main' $tmp; then
+  echo "ok 1 - the program is compiled and optimized"
+else
+  echo "not ok 1 - the program is compiled and optimized"
+fi
+
+loop_blocks > $tmp.loop
+
+# Make sure that the checks below look at the loop body.
+if grep -q '@__print_int' $tmp.loop; then
+  echo "ok 2 - the loop calling print_int is found"
+else
+  echo "not ok 2 - the loop calling print_int is found"
+fi
+
+# The length and first character of s are the only memory the loop
+# would read.
+if grep -q '@__print_int' $tmp.loop && ! grep -q '= load ' $tmp.loop; then
+  echo "ok 3 - nothing is loaded inside the loop"
+else
+  echo "not ok 3 - nothing is loaded inside the loop"
+fi
+
+if grep -q '@__print_int' $tmp.loop && ! grep -qE '@__(size|ord)\(' $tmp.loop; then
+  echo "ok 4 - size and ord are not called inside the loop"
+else
+  echo "not ok 4 - size and ord are not called inside the loop"
+fi
+
+# Comparisons only read memory, so one between strings the loop does
+# not change is done once, before the loop.
+$DTIGER -i --dump-ir - <<EOF | $OPT -O3 -S -o $tmp -
+let var s := concat("hello, ", "world")
+    var t := concat("hello, ", "there")
+    var n := 0
+    var i := 0
+in while i < 1000 do (
+     if s = t then n := n + 1;
+     i := i + 1);
+   print_int(n)
+end
+EOF
+
+if grep -q 'call i32 @__streq(' $tmp; then
+  echo "ok 5 - the comparison is compiled to a call"
+else
+  echo "not ok 5 - the comparison is compiled to a call"
+fi
+
+loop_blocks > $tmp.loop
+
+if grep -q 'call i32 @__streq(' $tmp && ! grep -q '@__streq(' $tmp.loop; then
+  echo "ok 6 - the comparison is not done inside a loop"
+else
+  echo "not ok 6 - the comparison is not done inside a loop"
+fi
@@ -0,0 +1,41 @@
+#! /bin/sh
+#
+# Check that calls in tail position between functions of the same
+# prototype are guaranteed to reuse the stack, even when the IR is not
+# optimized. Prints its results in the TAP format.
+
+DTIGER=${DTIGER:-../driver/dtiger}
+
+tmp=$(mktemp)
+trap 'rm -f $tmp' EXIT
+
+echo "1..3"
+
+$DTIGER -i --dump-ir - > $tmp <<EOF
+let function loop(n: int, acc: int): int =
+      if n = 0 then acc else loop(n - 1, acc + 1)
+    function even(n: int): int = if n = 0 then 1 else odd(n - 1)
+    function odd(n: int): int = if n = 0 then 0 else even(n - 1)
+in print_int(loop(10000000, 0));
+   print_int(even(10000001))
+end
+EOF
+
+if grep -q '^define.*@main' $tmp; then
+  echo "ok 1 - the program is compiled"
+else
+  echo "not ok 1 - the program is compiled"
+fi
+
+if grep -q 'musttail call .*@main\.loop(' $tmp; then
+  echo "ok 2 - the self call is a guaranteed tail call"
+else
+  echo "not ok 2 - the self call is a guaranteed tail call"
+fi
+
+if grep -q 'musttail call .*@main\.odd(' $tmp &&
+   grep -q 'musttail call .*@main\.even(' $tmp; then
+  echo "ok 3 - the mutually recursive calls are guaranteed tail calls"
+else
+  echo "not ok 3 - the mutually recursive calls are guaranteed tail calls"
+fi
@@ -0,0 +1,279 @@
+// Microbenchmarks of the runtime primitives, built with "make bench".
+//
+// Usage: bench [name...]
+//
+// Every benchmark is run a few times and its best time is reported.
+// The kernels comparing and copying characters are also measured on
+// their own, on heap strings of every power of two from 1 byte to 1 MiB;
+// run with TIGER_SIMD set to compare their versions (see runtime.h).
+// What the benchmarks print goes to /dev/null.
+// The kernels are static functions of the runtime, so the runtime is
+// compiled into this program rather than linked with it.
+
+#include <fcntl.h>
+
+#include "runtime.c"
+
+#define RUNS 5
+
+static volatile int32_t sink;
+
+// Strings kept alive across allocations, registered in the shadow stack
+// of the garbage collector like the variables of the generated code.
+static const char *root;
+static const char *other_root;
+
+// Build a string of 2^log_length characters.
+static const char *make_string(int log_length) {
+  const char *s = __chr('a');
+  for (int i = 0; i < log_length; i++) {
+    s = __concat(s, s);
+  }
+  return s;
+}
+
+// Grow a string one character at a time.
+static void bench_concat(void) {
+  root = __chr(0);
+  for (int32_t i = 0; i < 10000; i++) {
+    root = __concat(root, __chr('a' + i % 26));
+  }
+  sink = __size(root);
+  root = NULL;
+}
+
+// Grow a long string one character at a time, as s := concat(s, x)
+// does in a loop, then print it.
+static void bench_concat_append(void) {
+  root = __chr(0);
+  for (int32_t i = 0; i < 100000; i++) {
+    root = __concat(root, __chr('a' + i % 26));
+  }
+  __print(root);
+  __flush();
+  root = NULL;
+}
+
+static void bench_size(void) {
+  const char *s = make_string(16);
+  for (int32_t i = 0; i < 100000; i++) {
+    sink = __size(s);
+  }
+}
+
+static void bench_substring(void) {
+  const char *s = make_string(16);
+  for (int32_t i = 0; i < 20000; i++) {
+    sink = __ord(__substring(s, i % 1024, 1024));
+  }
+}
+
+// Print long slices of a string.
+static void bench_substring_print(void) {
+  root = make_string(20);
+  for (int32_t i = 0; i < 2000; i++) {
+    __print(__substring(root, i * 64, 65536));
+  }
+  __flush();
+  root = NULL;
+}
+
+// Cut a string into tokens and compare each of them, as a tokenizer
+// would.
+static void bench_substring_tokens(void) {
+  root = make_string(20);
+  for (int32_t i = 0; i < 1000000; i++) {
+    sink = __strcmp(__substring(root, i % 10000 * 100, 100), root);
+  }
+  root = NULL;
+}
+
+// Cut a string into words of a few characters and compare them.
+static void bench_substring_words(void) {
+  root = make_string(12);
+  for (int32_t i = 0; i < 1000000; i++) {
+    sink = __streq(__substring(root, i % 4000, 1 + i % 7), __chr('a'));
+  }
+  root = NULL;
+}
+
+// Short strings, most of them unreachable right away.
+static void bench_concat_short(void) {
+  root = __chr('a');
+  for (int32_t i = 0; i < 1000000; i++) {
+    sink = __size(__concat(root, root));
+  }
+  root = NULL;
+}
+
+static void bench_substring_short(void) {
+  root = make_string(10);
+  for (int32_t i = 0; i < 1000000; i++) {
+    sink = __ord(__substring(root, i % 1000, 16));
+  }
+  root = NULL;
+}
+
+// Scan a string one character at a time.
+static void bench_substring_char(void) {
+  root = make_string(10);
+  for (int32_t i = 0; i < 1000000; i++) {
+    sink = __ord(__substring(root, i % 1024, 1));
+  }
+  root = NULL;
+}
+
+static void bench_print(void) {
+  root = make_string(4);
+  for (int32_t i = 0; i < 1000000; i++) {
+    __print(root);
+  }
+  __flush();
+  root = NULL;
+}
+
+static void bench_print_int(void) {
+  for (int32_t i = 0; i < 1000000; i++) {
+    __print_int((i - 500000) * 4093);
+  }
+  __flush();
+}
+
+// The kernels run on root and other_root, two heap strings of
+// kernel_length equal characters. The barrier keeps the compiler from
+// taking the kernels out of the loops, or from dropping copies which
+// are never read.
+static size_t kernel_length;
+
+#define BARRIER() __asm__ volatile("" ::: "memory")
+
+static void kernel_equal(int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    BARRIER();
+    sink = chars_equal(root, other_root, kernel_length);
+  }
+}
+
+static void kernel_compare(int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    BARRIER();
+    sink = chars_compare(root, other_root, kernel_length);
+  }
+}
+
+static void kernel_copy(int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    BARRIER();
+    chars_copy((char *)other_root, root, kernel_length);
+  }
+}
+
+// Allocate a heap string of the given length, even when it would fit in
+// a small string.
+static const char *make_heap_string(int32_t length) {
+  char *s = alloc_string(length);
+  memset(s, 'a', length);
+  return s;
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benchmarks[] = {
+  {"concat", bench_concat},
+  {"concat_append", bench_concat_append},
+  {"size", bench_size},
+  {"substring", bench_substring},
+  {"substring_print", bench_substring_print},
+  {"substring_tokens", bench_substring_tokens},
+  {"substring_words", bench_substring_words},
+  {"concat_short", bench_concat_short},
+  {"substring_short", bench_substring_short},
+  {"substring_char", bench_substring_char},
+  {"print", bench_print},
+  {"print_int", bench_print_int},
+};
+
+static const struct {
+  const char *name;
+  void (*run)(int32_t count);
+} kernels[] = {
+  {"equal", kernel_equal},
+  {"compare", kernel_compare},
+  {"copy", kernel_copy},
+};
+
+// Kernels are measured on strings of 2^i characters, for about the same
+// number of characters whatever the length.
+#define KERNEL_LOG_LENGTHS 21
+#define KERNEL_CHARS (64 << 20)
+
+static int selected(const char *name, int argc, char **argv) {
+  if (argc < 2) {
+    return 1;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], name)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct gc_frame *frame =
+      malloc(sizeof(*frame) + 2 * sizeof(frame->roots[0]));
+  frame->prev = __gc_roots;
+  frame->count = 2;
+  frame->roots[0] = &root;
+  frame->roots[1] = &other_root;
+  __gc_roots = frame;
+
+  int report = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+    if (!selected(benchmarks[b].name, argc, argv)) {
+      continue;
+    }
+    double best = 0;
+    for (int run = 0; run < RUNS; run++) {
+      double start = now();
+      benchmarks[b].run();
+      double elapsed = now() - start;
+      if (run == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    dprintf(report, "%-16s %10.3f ms\n", benchmarks[b].name, best * 1e3);
+  }
+
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (!selected(kernels[k].name, argc, argv)) {
+      continue;
+    }
+    for (int log_length = 0; log_length < KERNEL_LOG_LENGTHS; log_length++) {
+      int32_t length = 1 << log_length;
+      int32_t count = KERNEL_CHARS / (length + 64);
+      root = make_heap_string(length);
+      other_root = make_heap_string(length);
+      kernel_length = length;
+      double best = 0;
+      for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        kernels[k].run(count);
+        double elapsed = now() - start;
+        if (run == 0 || elapsed < best) {
+          best = elapsed;
+        }
+      }
+      char name[32];
+      snprintf(name, sizeof(name), "%s %d", kernels[k].name, length);
+      dprintf(report, "%-16s %10.3f ns\n", name, best / count * 1e9);
+    }
+    root = other_root = NULL;
+  }
+  return 0;
+}
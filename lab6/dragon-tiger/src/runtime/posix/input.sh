@@ -0,0 +1,82 @@
+#! /bin/sh
+#
+# Check that read_line and read_all return the standard input, whether
+# it is a pipe or a regular file, and however long its lines are.
+# Prints its results in the TAP format.
+
+DTIGER=${DTIGER:-../../driver/dtiger}
+OPT=${OPT:-opt}
+LLC=${LLC:-llc}
+CC=${CC:-cc}
+RUNTIME=${RUNTIME:-libruntime.a}
+
+tmp=$(mktemp)
+trap 'rm -f $tmp $tmp.s $tmp.echo $tmp.sizes $tmp.in' EXIT
+
+# Compile the program given on the standard input into the executable $1.
+compile() {
+  $DTIGER -i --dump-ir - | $OPT -O3 | $LLC -O3 -relocation-model=pic -o $tmp.s &&
+    $CC -o $1 $tmp.s $RUNTIME
+}
+
+echo "1..6"
+
+compile $tmp.echo <<EOF
+let var first := read_line()
+    var rest := read_all()
+in print(first); print("|");
+   print(rest); print("|");
+   print(read_line()); print(read_all()); print("|")
+end
+EOF
+
+compile $tmp.sizes <<EOF
+let var line := read_line()
+in while size(line) > 0 do (
+     print_int(size(line)); print(" ");
+     line := read_line())
+end
+EOF
+
+if [ -x $tmp.echo ] && [ -x $tmp.sizes ]; then
+  echo "ok 1 - the programs are compiled"
+else
+  echo "not ok 1 - the programs are compiled"
+fi
+
+expected=$(printf 'one\n|two\nthree||')
+
+if [ "$(printf 'one\ntwo\nthree' | $tmp.echo)" = "$expected" ]; then
+  echo "ok 2 - a pipe is read by lines and as a whole"
+else
+  echo "not ok 2 - a pipe is read by lines and as a whole"
+fi
+
+printf 'one\ntwo\nthree' > $tmp.in
+if [ "$($tmp.echo < $tmp.in)" = "$expected" ]; then
+  echo "ok 3 - a regular file is read by lines and as a whole"
+else
+  echo "not ok 3 - a regular file is read by lines and as a whole"
+fi
+
+if [ "$($tmp.echo < /dev/null)" = "|||" ]; then
+  echo "ok 4 - an empty input gives empty strings"
+else
+  echo "not ok 4 - an empty input gives empty strings"
+fi
+
+# The newline is kept, so that only the end of the input gives an empty
+# line. The long line does not fit in the buffer of the runtime.
+awk 'BEGIN { while (n++ < 100000) printf "x"; print ""; print ""; print "end" }' > $tmp.in
+
+if [ "$($tmp.sizes < $tmp.in)" = "100001 1 4 " ]; then
+  echo "ok 5 - lines are read from a regular file"
+else
+  echo "not ok 5 - lines are read from a regular file"
+fi
+
+if [ "$(cat $tmp.in | $tmp.sizes)" = "100001 1 4 " ]; then
+  echo "ok 6 - lines longer than a read are read from a pipe"
+else
+  echo "not ok 6 - lines longer than a read are read from a pipe"
+fi
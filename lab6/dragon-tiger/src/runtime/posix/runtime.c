@@ -1,6 +1,14 @@
+#include <errno.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "runtime.h"
 
@@ -10,115 +18,1312 @@ static void error(const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+// Strings larger than a quarter of a chunk are allocated on their own
+// and chained, so that the sweep can find the ones which are no longer
+// reachable.
+struct gc_object {
+  struct gc_object *next;
+  struct string_header header;
+  char chars[];
+};
+
+// Other strings are bump allocated one after the other in chunks. A
+// chunk is freed once none of its strings is reachable.
+struct gc_chunk {
+  struct gc_chunk *next;
+  // End of the strings allocated in the chunk.
+  char *top;
+  char data[];
+};
+
+struct gc_frame *__gc_roots;
+
+// Arguments a primitive still needs while it allocates its result.
+static const char *held[2];
+
+// Concatenations at least this long build a rope rather than copying
+// their operands, so that growing a string one piece at a time takes
+// linear time. Shorter strings are never ropes.
+#define ROPE_LENGTH 256
+
+// Leaves of ropes shorter than this are copied rather than shared when
+// a short string is concatenated next to them.
+#define LEAF_LENGTH 64
+
+// A rope keeps its header and first character where the generated code
+// expects them, so that size, ord and the inline part of the equality
+// work on it as on any string. Its characters are those of left followed
+// by those of right until it is flattened: left then holds a flat copy
+// and right is NULL.
+struct rope {
+  char chars[8];
+  const char *left;
+  const char *right;
+};
+
+// Substrings at least this long are views sharing the characters of the
+// string they are taken from, which they keep alive, rather than
+// copies.
+#define VIEW_LENGTH 64
+
+// Like a rope, a view keeps its header and first character where the
+// generated code expects them. Its characters start at start, in the
+// flat string or literal parent.
+struct view {
+  char chars[8];
+  const char *parent;
+  const char *start;
+};
+
+// Strings left to visit by the traversals of ropes, which do not recurse
+// as the ropes built by a loop are as deep as the loop is long.
+struct string_stack {
+  const char **data;
+  size_t size;
+  size_t capacity;
+};
+
+static struct string_stack pending;
+
+// Stacks of the two strings walked by a comparison.
+static struct string_stack compared[2];
+
+// Free part of the chunk strings are currently allocated from.
+static struct {
+  struct gc_chunk *chunk;
+  char *next;
+  char *limit;
+} region;
+
+static struct {
+  int initialized;
+  struct gc_object *objects;
+  struct gc_chunk *chunks;
+  size_t chunk_size;
+  size_t large_size;
+  // Set while allocating from primitives which must not collect.
+  int deferred;
+  // Bytes currently allocated, and bytes triggering a collection.
+  size_t heap;
+  size_t threshold;
+  size_t initial_threshold;
+  double growth;
+  // Statistics.
+  int stats;
+  unsigned collections;
+  size_t allocated;
+  size_t freed;
+  size_t peak;
+  double pause;
+  double max_pause;
+} gc;
+
+// Number of bytes following the header of a string.
+static size_t payload_size(const struct string_header *header) {
+  if (header->flags & STRING_ROPE) {
+    return sizeof(struct rope);
+  }
+  if (header->flags & STRING_VIEW) {
+    return sizeof(struct view);
+  }
+  return (size_t)header->length + 1;
+}
+
+static size_t object_size(size_t payload) {
+  return sizeof(struct gc_object) + payload;
+}
+
+// Size of a string in a chunk, rounded so that the next header stays
+// aligned.
+static size_t chunk_string_size(size_t payload) {
+  size_t size = sizeof(struct string_header) + payload;
+  return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static void stack_push(struct string_stack *stack, const char *s) {
+  if (stack->size == stack->capacity) {
+    stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+    stack->data =
+        realloc(stack->data, stack->capacity * sizeof(stack->data[0]));
+    if (!stack->data) {
+      error("out of memory");
+    }
+  }
+  stack->data[stack->size++] = s;
+}
+
+// Return the small string holding the given characters.
+static const char *small_string(const char *chars, size_t length) {
+  uintptr_t value = 0;
+  for (size_t i = length; i > 0; i--) {
+    value = value << 8 | (unsigned char)chars[i - 1];
+  }
+  return (const char *)(value << 8 | length << 1 | 1);
+}
+
+// Decode the characters of a small string into buffer, which must hold
+// SMALL_STRING_LENGTH characters.
+static const char *small_chars(const char *s, char *buffer) {
+  uintptr_t value = (uintptr_t)s >> 8;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(buffer, &value, SMALL_STRING_LENGTH);
+#else
+  for (size_t i = 0; i < SMALL_STRING_LENGTH; i++) {
+    buffer[i] = (char)(value >> 8 * i);
+  }
+#endif
+  return buffer;
+}
+
+// Return the characters of a small string as an integer, the first one
+// in the most significant byte.
+static uintptr_t small_order(const char *s) {
+  uintptr_t chars = (uintptr_t)s >> 8;
+  return sizeof(chars) == 8 ? __builtin_bswap64(chars)
+                            : __builtin_bswap32(chars);
+}
+
+static const char *empty_string(void) {
+  return small_string(NULL, 0);
+}
+
+static const char *char_string(char c) {
+  return small_string(&c, 1);
+}
+
+// Return the small string made of length characters of the small
+// string s, starting at first.
+static const char *small_substring(const char *s, int32_t first,
+                                   int32_t length) {
+  // first may be SMALL_STRING_LENGTH, shifting the whole pointer out.
+  if (!length) {
+    return empty_string();
+  }
+  uintptr_t chars = (uintptr_t)s >> 8 * (first + 1);
+  uintptr_t mask = ((uintptr_t)1 << 8 * length) - 1;
+  return (const char *)((chars & mask) << 8 | (uintptr_t)length << 1 | 1);
+}
+
+// Return the first character of a non-empty string, which ropes and
+// views keep at hand.
+static char first_char(const char *s) {
+  return STRING_IS_SMALL(s) ? (char)((uintptr_t)s >> 8) : s[0];
+}
+
+// Return s as a rope if it is one which has not been flattened yet, NULL
+// otherwise.
+static struct rope *lazy_rope(const char *s) {
+  if (!STRING_IS_SMALL(s) && (STRING_HEADER(s)->flags & STRING_ROPE)) {
+    struct rope *rope = (struct rope *)s;
+    if (rope->right) {
+      return rope;
+    }
+  }
+  return NULL;
+}
+
+// Return the string a rope should refer to for s: the flat copy of s if
+// it is a flattened rope, s itself otherwise.
+static const char *rope_child(const char *s) {
+  if (!STRING_IS_SMALL(s) && (STRING_HEADER(s)->flags & STRING_ROPE)) {
+    const struct rope *rope = (const struct rope *)s;
+    if (!rope->right) {
+      return rope->left;
+    }
+  }
+  return s;
+}
+
+// Return the characters of a string which is neither small nor a rope
+// waiting to be flattened.
+static const char *flat_chars(const char *s) {
+  if (STRING_HEADER(s)->flags & STRING_VIEW) {
+    return ((const struct view *)s)->start;
+  }
+  return rope_child(s);
+}
+
+// Return the flat string or literal holding the characters of a string
+// which is not a rope waiting to be flattened.
+static const char *flat_parent(const char *s) {
+  if (STRING_HEADER(s)->flags & STRING_VIEW) {
+    return ((const struct view *)s)->parent;
+  }
+  return rope_child(s);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void gc_print_stats(void) {
+  fprintf(stderr,
+          "gc: %u collections, %.3f ms total pause, %.3f ms max pause\n"
+          "gc: %zu bytes allocated, %zu freed, %zu peak heap\n",
+          gc.collections, gc.pause * 1e3, gc.max_pause * 1e3,
+          gc.allocated, gc.freed, gc.peak);
+}
+
+// Give all the memory of the heap back, whether reachable or not.
+static void gc_release(void) {
+  while (gc.objects) {
+    struct gc_object *object = gc.objects;
+    gc.objects = object->next;
+    free(object);
+  }
+  while (gc.chunks) {
+    struct gc_chunk *chunk = gc.chunks;
+    gc.chunks = chunk->next;
+    free(chunk);
+  }
+  region.chunk = NULL;
+  region.next = region.limit = NULL;
+  gc.heap = 0;
+}
+
+// Read a size in bytes from the environment, with an optional k, M or
+// G suffix.
+static size_t env_size(const char *name, size_t size) {
+  const char *value = getenv(name);
+  if (value) {
+    char *end;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (end != value) {
+      switch (*end) {
+      case 'G': case 'g': parsed <<= 10; // Fall through.
+      case 'M': case 'm': parsed <<= 10; // Fall through.
+      case 'K': case 'k': parsed <<= 10;
+      }
+      size = parsed;
+    }
+  }
+  return size;
+}
+
+static void gc_init(void) {
+  gc.initialized = 1;
+  gc.initial_threshold = env_size("TIGER_GC_HEAP", 4 << 20);
+  gc.threshold = gc.initial_threshold;
+  gc.chunk_size = env_size("TIGER_GC_CHUNK", 64 << 10);
+  gc.large_size = gc.chunk_size / 4;
+
+  const char *growth = getenv("TIGER_GC_GROWTH");
+  gc.growth = growth ? atof(growth) : 0;
+  if (gc.growth < 1) {
+    gc.growth = 2;
+  }
+
+  if (getenv("TIGER_GC_RELEASE")) {
+    atexit(gc_release);
+  }
+  gc.stats = getenv("TIGER_GC_STATS") != NULL;
+  if (gc.stats) {
+    atexit(gc_print_stats);
+  }
+}
+
+static void gc_mark(const char *s) {
+  for (;;) {
+    // Small strings and literals live outside of the heap and are never
+    // marked.
+    if (s && !STRING_IS_SMALL(s) &&
+        (STRING_HEADER(s)->flags & (STRING_HEAP | STRING_MARKED)) ==
+            STRING_HEAP) {
+      struct string_header *header = (struct string_header *)s - 1;
+      header->flags |= STRING_MARKED;
+      if (header->flags & STRING_ROPE) {
+        const struct rope *rope = (const struct rope *)s;
+        if (rope->right) {
+          stack_push(&pending, rope->right);
+        }
+        s = rope->left;
+        continue;
+      }
+      if (header->flags & STRING_VIEW) {
+        s = ((const struct view *)s)->parent;
+        continue;
+      }
+    }
+    if (!pending.size) {
+      return;
+    }
+    s = pending.data[--pending.size];
+  }
+}
+
+static void gc_sweep_objects(void) {
+  struct gc_object **link = &gc.objects;
+  while (*link) {
+    struct gc_object *object = *link;
+    if (object->header.flags & STRING_MARKED) {
+      object->header.flags &= ~STRING_MARKED;
+      link = &object->next;
+    } else {
+      size_t size = object_size(payload_size(&object->header));
+      gc.heap -= size;
+      gc.freed += size;
+      *link = object->next;
+      free(object);
+    }
+  }
+}
+
+static void gc_sweep_chunks(void) {
+  if (region.chunk) {
+    region.chunk->top = region.next;
+  }
+
+  struct gc_chunk **link = &gc.chunks;
+  while (*link) {
+    struct gc_chunk *chunk = *link;
+    int live = 0;
+    for (char *p = chunk->data; p < chunk->top;) {
+      struct string_header *header = (struct string_header *)p;
+      size_t size = chunk_string_size(payload_size(header));
+      if (header->flags & STRING_MARKED) {
+        header->flags &= ~STRING_MARKED;
+        live = 1;
+      } else if (header->flags & STRING_HEAP) {
+        // Dead strings stay in the chunk until it is freed, they are
+        // only counted once. Their size must still be known to walk the
+        // chunk.
+        header->flags &= STRING_ROPE | STRING_VIEW;
+        gc.freed += size;
+      }
+      p += size;
+    }
+
+    if (live) {
+      link = &chunk->next;
+    } else if (chunk == region.chunk) {
+      // Keep allocating from the start of the current chunk.
+      region.next = chunk->top = chunk->data;
+      link = &chunk->next;
+    } else {
+      gc.heap -= gc.chunk_size;
+      *link = chunk->next;
+      free(chunk);
+    }
+  }
+}
+
+static void gc_collect(void) {
+  double start = now();
+
+  for (struct gc_frame *frame = __gc_roots; frame; frame = frame->prev) {
+    for (int32_t i = 0; i < frame->count; i++) {
+      gc_mark(*frame->roots[i]);
+    }
+  }
+  gc_mark(held[0]);
+  gc_mark(held[1]);
+
+  gc_sweep_objects();
+  gc_sweep_chunks();
+
+  size_t threshold = gc.heap * gc.growth;
+  gc.threshold =
+      threshold > gc.initial_threshold ? threshold : gc.initial_threshold;
+
+  double pause = now() - start;
+  gc.collections++;
+  gc.pause += pause;
+  if (pause > gc.max_pause) {
+    gc.max_pause = pause;
+  }
+}
+
+static void gc_grow(size_t size) {
+  gc.heap += size;
+  if (gc.heap > gc.peak) {
+    gc.peak = gc.heap;
+  }
+}
+
+// Allocation path taken when the current chunk is full.
+static struct string_header *alloc_slow(size_t payload, size_t size) {
+  if (!gc.initialized) {
+    gc_init();
+  }
+
+  if (size > gc.large_size) {
+    size_t large = object_size(payload);
+    if (!gc.deferred && gc.heap + large > gc.threshold) {
+      gc_collect();
+    }
+    struct gc_object *object = malloc(large);
+    if (!object) {
+      error("out of memory");
+    }
+    object->next = gc.objects;
+    gc.objects = object;
+    gc_grow(large);
+    return &object->header;
+  }
+
+  // The collection may leave room in the current chunk.
+  if (!gc.deferred && gc.heap + gc.chunk_size > gc.threshold) {
+    gc_collect();
+  }
+  if (size > (size_t)(region.limit - region.next)) {
+    struct gc_chunk *chunk = malloc(sizeof(struct gc_chunk) + gc.chunk_size);
+    if (!chunk) {
+      error("out of memory");
+    }
+    if (region.chunk) {
+      region.chunk->top = region.next;
+    }
+    chunk->next = gc.chunks;
+    chunk->top = chunk->data;
+    gc.chunks = chunk;
+    gc_grow(gc.chunk_size);
+    region.chunk = chunk;
+    region.next = chunk->data;
+    region.limit = chunk->data + gc.chunk_size;
+  }
+  struct string_header *header = (struct string_header *)region.next;
+  region.next += size;
+  return header;
+}
+
+// Allocate a header followed by payload bytes. The arguments of the
+// calling primitive must be in held if they are used afterwards.
+static struct string_header *alloc_header(size_t payload) {
+  size_t size = chunk_string_size(payload);
+  struct string_header *header;
+  if (size <= (size_t)(region.limit - region.next)) {
+    header = (struct string_header *)region.next;
+    region.next += size;
+  } else {
+    header = alloc_slow(payload, size);
+  }
+  gc.allocated += size;
+  return header;
+}
+
+// Allocate a string able to hold length characters. The length and
+// the terminating NUL character are already set.
+static char *alloc_string(int32_t length) {
+  struct string_header *header = alloc_header((size_t)length + 1);
+  header->flags = STRING_HEAP;
+  header->length = length;
+  char *s = (char *)(header + 1);
+  s[length] = '\0';
+  return s;
+}
+
+// Kernels comparing and copying the characters of strings. The C
+// library has vector loops of its own, picked for the processor, but
+// calling them costs as much as comparing or copying a short string. On
+// x86-64, strings of up to four vectors are handled inline instead: with
+// SSE2, which every such processor has, and with AVX2 for up to 128
+// characters when the processor supports it, as found out once at
+// startup. Reading the first and the last vectors, which overlap unless
+// the length is a multiple of theirs, covers every length. Longer
+// strings, and every string on other targets, are left to the C library.
+// So is looking for a newline: memchr checks the first vector as fast
+// as an inline kernel does.
+#ifdef __x86_64__
+enum simd { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+static enum simd simd;
+
+__attribute__((constructor))
+static void simd_init(void) {
+  __builtin_cpu_init();
+  simd = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+  const char *level = getenv("TIGER_SIMD");
+  if (level && !strcmp(level, "none")) {
+    simd = SIMD_NONE;
+  } else if (level && !strcmp(level, "sse2")) {
+    simd = SIMD_SSE2;
+  }
+}
+
+// Strings shorter than a vector are handled as two words of 8 or 4
+// characters, or one character at a time.
+static uint64_t load8(const char *p) {
+  uint64_t word;
+  memcpy(&word, p, 8);
+  return word;
+}
+
+static uint32_t load4(const char *p) {
+  uint32_t word;
+  memcpy(&word, p, 4);
+  return word;
+}
+
+static int equal_short(const char *a, const char *b, size_t length) {
+  if (length >= 8) {
+    return !((load8(a) ^ load8(b)) |
+             (load8(a + length - 8) ^ load8(b + length - 8)));
+  }
+  if (length >= 4) {
+    return !((load4(a) ^ load4(b)) |
+             (load4(a + length - 4) ^ load4(b + length - 4)));
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Words read with their first character in the most significant byte
+// compare as their characters do.
+static int compare_short(const char *a, const char *b, size_t length) {
+  if (length >= 8) {
+    uint64_t wa = __builtin_bswap64(load8(a));
+    uint64_t wb = __builtin_bswap64(load8(b));
+    if (wa == wb) {
+      wa = __builtin_bswap64(load8(a + length - 8));
+      wb = __builtin_bswap64(load8(b + length - 8));
+    }
+    return (wa > wb) - (wa < wb);
+  }
+  if (length >= 4) {
+    uint32_t wa = __builtin_bswap32(load4(a));
+    uint32_t wb = __builtin_bswap32(load4(b));
+    if (wa == wb) {
+      wa = __builtin_bswap32(load4(a + length - 4));
+      wb = __builtin_bswap32(load4(b + length - 4));
+    }
+    return (wa > wb) - (wa < wb);
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (a[i] != b[i]) {
+      return (unsigned char)a[i] - (unsigned char)b[i];
+    }
+  }
+  return 0;
+}
+
+// Given a length it knows to be short, GCC would expand memcpy into a
+// rep movs, which is slow to start.
+static void copy_short(char *dest, const char *src, size_t length) {
+  if (length >= 8) {
+    uint64_t first = load8(src);
+    uint64_t last = load8(src + length - 8);
+    memcpy(dest, &first, 8);
+    memcpy(dest + length - 8, &last, 8);
+  } else if (length >= 4) {
+    uint32_t first = load4(src);
+    uint32_t last = load4(src + length - 4);
+    memcpy(dest, &first, 4);
+    memcpy(dest + length - 4, &last, 4);
+  } else {
+    for (size_t i = 0; i < length; i++) {
+      dest[i] = src[i];
+    }
+  }
+}
+
+// Return a vector with all the bits of a character set when the
+// characters of a and b at this position are equal.
+static __m128i same_sse2(const char *a, const char *b) {
+  return _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+                        _mm_loadu_si128((const __m128i *)b));
+}
+
+static int all_sse2(__m128i same) {
+  return _mm_movemask_epi8(same) == 0xffff;
+}
+
+// Compare the vectors at a and b as memcmp does.
+static int compare_vector_sse2(const char *a, const char *b) {
+  unsigned different = _mm_movemask_epi8(same_sse2(a, b)) ^ 0xffff;
+  if (!different) {
+    return 0;
+  }
+  int i = __builtin_ctz(different);
+  return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+static void copy_vector_sse2(char *dest, const char *src) {
+  _mm_storeu_si128((__m128i *)dest,
+                   _mm_loadu_si128((const __m128i *)src));
+}
+
+// The following kernels take from 16 to 64 characters.
+static int equal_sse2(const char *a, const char *b, size_t length) {
+  __m128i same = _mm_and_si128(same_sse2(a, b),
+                               same_sse2(a + length - 16, b + length - 16));
+  if (length > 32) {
+    same = _mm_and_si128(
+        same, _mm_and_si128(same_sse2(a + 16, b + 16),
+                            same_sse2(a + length - 32, b + length - 32)));
+  }
+  return all_sse2(same);
+}
+
+static int compare_sse2(const char *a, const char *b, size_t length) {
+  int c = compare_vector_sse2(a, b);
+  if (length > 32) {
+    if (!c) {
+      c = compare_vector_sse2(a + 16, b + 16);
+    }
+    if (!c) {
+      c = compare_vector_sse2(a + length - 32, b + length - 32);
+    }
+  }
+  return c ? c : compare_vector_sse2(a + length - 16, b + length - 16);
+}
+
+static void copy_sse2(char *dest, const char *src, size_t length) {
+  copy_vector_sse2(dest, src);
+  if (length > 32) {
+    copy_vector_sse2(dest + 16, src + 16);
+    copy_vector_sse2(dest + length - 32, src + length - 32);
+  }
+  copy_vector_sse2(dest + length - 16, src + length - 16);
+}
+
+// The same with AVX2 vectors, for 65 to 128 characters.
+__attribute__((target("avx2")))
+static __m256i same_avx2(const char *a, const char *b) {
+  return _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)a),
+                           _mm256_loadu_si256((const __m256i *)b));
+}
+
+__attribute__((target("avx2")))
+static int compare_vector_avx2(const char *a, const char *b) {
+  unsigned different = ~(unsigned)_mm256_movemask_epi8(same_avx2(a, b));
+  if (!different) {
+    return 0;
+  }
+  int i = __builtin_ctz(different);
+  return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+__attribute__((target("avx2")))
+static int equal_avx2(const char *a, const char *b, size_t length) {
+  __m256i same = _mm256_and_si256(
+      _mm256_and_si256(same_avx2(a, b), same_avx2(a + 32, b + 32)),
+      _mm256_and_si256(same_avx2(a + length - 64, b + length - 64),
+                       same_avx2(a + length - 32, b + length - 32)));
+  return (unsigned)_mm256_movemask_epi8(same) == 0xffffffffu;
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2(const char *a, const char *b, size_t length) {
+  int c = compare_vector_avx2(a, b);
+  if (!c) {
+    c = compare_vector_avx2(a + 32, b + 32);
+  }
+  if (!c) {
+    c = compare_vector_avx2(a + length - 64, b + length - 64);
+  }
+  return c ? c : compare_vector_avx2(a + length - 32, b + length - 32);
+}
+
+__attribute__((target("avx2")))
+static void copy_vector_avx2(char *dest, const char *src) {
+  _mm256_storeu_si256((__m256i *)dest,
+                      _mm256_loadu_si256((const __m256i *)src));
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char *dest, const char *src, size_t length) {
+  copy_vector_avx2(dest, src);
+  copy_vector_avx2(dest + 32, src + 32);
+  copy_vector_avx2(dest + length - 64, src + length - 64);
+  copy_vector_avx2(dest + length - 32, src + length - 32);
+}
+#endif
+
+// Tell whether length characters at a and b are equal.
+static int chars_equal(const char *a, const char *b, size_t length) {
+#ifdef __x86_64__
+  if (simd != SIMD_NONE) {
+    if (length < 16) {
+      return equal_short(a, b, length);
+    }
+    if (length <= 64) {
+      return equal_sse2(a, b, length);
+    }
+    if (length <= 128 && simd == SIMD_AVX2) {
+      return equal_avx2(a, b, length);
+    }
+  }
+#endif
+  return !memcmp(a, b, length);
+}
+
+// Compare length characters at a and b as memcmp does.
+static int chars_compare(const char *a, const char *b, size_t length) {
+#ifdef __x86_64__
+  if (simd != SIMD_NONE) {
+    if (length < 16) {
+      return compare_short(a, b, length);
+    }
+    if (length <= 64) {
+      return compare_sse2(a, b, length);
+    }
+    if (length <= 128 && simd == SIMD_AVX2) {
+      return compare_avx2(a, b, length);
+    }
+  }
+#endif
+  return memcmp(a, b, length);
+}
+
+// Copy length characters from src to dest, which do not overlap.
+static void chars_copy(char *dest, const char *src, size_t length) {
+#ifdef __x86_64__
+  if (simd != SIMD_NONE) {
+    if (length < 16) {
+      copy_short(dest, src, length);
+      return;
+    }
+    if (length <= 64) {
+      copy_sse2(dest, src, length);
+      return;
+    }
+    if (length <= 128 && simd == SIMD_AVX2) {
+      copy_avx2(dest, src, length);
+      return;
+    }
+  }
+#endif
+  memcpy(dest, src, length);
+}
+
+// Allocate a rope of the given length, whose first character and
+// children are left to the caller.
+static struct rope *alloc_rope(int32_t length) {
+  struct string_header *header = alloc_header(sizeof(struct rope));
+  header->flags = STRING_HEAP | STRING_ROPE;
+  header->length = length;
+  struct rope *rope = (struct rope *)(header + 1);
+  rope->chars[1] = '\0';
+  return rope;
+}
+
+// Allocate a view of the given length, whose first character and
+// characters are left to the caller.
+static struct view *alloc_view(int32_t length) {
+  struct string_header *header = alloc_header(sizeof(struct view));
+  header->flags = STRING_HEAP | STRING_VIEW;
+  header->length = length;
+  struct view *view = (struct view *)(header + 1);
+  view->chars[1] = '\0';
+  return view;
+}
+
+// Copy the characters of a rope to dest. Ropes are walked from the end,
+// going down their right children and keeping the left ones for later,
+// as s := concat(s, x) grows them to the left.
+static void rope_copy(char *dest, const char *s) {
+  char *end = dest + STRING_LENGTH(s);
+  for (;;) {
+    const struct rope *rope;
+    while ((rope = lazy_rope(s))) {
+      stack_push(&pending, rope->left);
+      s = rope->right;
+    }
+    int32_t length = STRING_LENGTH(s);
+    end -= length;
+    if (STRING_IS_SMALL(s)) {
+      char buffer[SMALL_STRING_LENGTH];
+      chars_copy(end, small_chars(s, buffer), length);
+    } else {
+      chars_copy(end, flat_chars(s), length);
+    }
+    if (!pending.size) {
+      return;
+    }
+    s = pending.data[--pending.size];
+  }
+}
+
+// Copy the characters of a rope once into a flat string which replaces
+// its children. This never runs the collector, so that the primitives
+// printing strings are not points where the generated code must keep
+// its strings in root slots.
+__attribute__((noinline))
+static void rope_flatten(struct rope *rope) {
+  gc.deferred = 1;
+  char *flat = alloc_string(STRING_LENGTH(rope->chars));
+  gc.deferred = 0;
+  rope_copy(flat, rope->chars);
+  rope->left = flat;
+  rope->right = NULL;
+}
+
+// Return the characters of a string, one after the other. Those of a
+// small string are decoded into buffer, which must hold
+// SMALL_STRING_LENGTH characters.
+static const char *string_chars(const char *s, char *buffer) {
+  if (STRING_IS_SMALL(s)) {
+    return small_chars(s, buffer);
+  }
+  if (!(STRING_HEADER(s)->flags & (STRING_ROPE | STRING_VIEW))) {
+    return s;
+  }
+  struct rope *rope = lazy_rope(s);
+  if (rope) {
+    rope_flatten(rope);
+  }
+  return flat_chars(s);
+}
+
+// Position in the characters of a string, walking the leaves of a rope
+// from the left without flattening it.
+struct string_cursor {
+  const char *chars;
+  // Characters left in the current leaf.
+  int32_t length;
+  struct string_stack *stack;
+  char buffer[SMALL_STRING_LENGTH];
+};
+
+static void cursor_enter(struct string_cursor *cursor, const char *s) {
+  const struct rope *rope;
+  while ((rope = lazy_rope(s))) {
+    stack_push(cursor->stack, rope->right);
+    s = rope->left;
+  }
+  cursor->length = STRING_LENGTH(s);
+  cursor->chars =
+      STRING_IS_SMALL(s) ? small_chars(s, cursor->buffer) : flat_chars(s);
+}
+
+static void cursor_advance(struct string_cursor *cursor, int32_t length) {
+  cursor->chars += length;
+  cursor->length -= length;
+  while (!cursor->length && cursor->stack->size) {
+    cursor_enter(cursor, cursor->stack->data[--cursor->stack->size]);
+  }
+}
+
+// Compare the first length characters of two strings as memcmp does,
+// or only tell whether they differ when equality is set. Ropes are
+// walked rather than flattened, so that comparisons write nothing the
+// program can see and LLVM may treat them as pure.
+static int strings_compare(const char *s1, const char *s2, int32_t length,
+                           int equality) {
+  struct string_cursor cursor1 = {.stack = &compared[0]};
+  struct string_cursor cursor2 = {.stack = &compared[1]};
+  compared[0].size = compared[1].size = 0;
+  cursor_enter(&cursor1, s1);
+  cursor_enter(&cursor2, s2);
+  while (length) {
+    int32_t n = cursor1.length < cursor2.length ? cursor1.length
+                                                : cursor2.length;
+    if (n > length) {
+      n = length;
+    }
+    int c = equality ? !chars_equal(cursor1.chars, cursor2.chars, n)
+                     : chars_compare(cursor1.chars, cursor2.chars, n);
+    if (c) {
+      return c;
+    }
+    length -= n;
+    cursor_advance(&cursor1, n);
+    cursor_advance(&cursor2, n);
+  }
+  return 0;
+}
+
+// Standard output goes through a buffer of the runtime written with
+// write(2) rather than through stdio. It is written when full, by
+// __flush and at exit. When it is a terminal, it is also written after
+// each line and before reading standard input, as stdio would do.
+// Standard error is left unbuffered.
+#define OUTPUT_SIZE (64 << 10)
+
+static struct {
+  int initialized;
+  int line_buffered;
+  size_t length;
+  char data[OUTPUT_SIZE];
+} output;
+
+static void write_all(int fd, const char *data, size_t length) {
+  while (length) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+static void output_flush(void) {
+  write_all(STDOUT_FILENO, output.data, output.length);
+  output.length = 0;
+}
+
+static void output_write(const char *s, size_t length) {
+  if (!output.initialized) {
+    output.initialized = 1;
+    output.line_buffered = isatty(STDOUT_FILENO);
+    atexit(output_flush);
+  }
+  if (length > OUTPUT_SIZE - output.length) {
+    output_flush();
+    if (length >= OUTPUT_SIZE) {
+      write_all(STDOUT_FILENO, s, length);
+      return;
+    }
+  }
+  memcpy(output.data + output.length, s, length);
+  output.length += length;
+  if (output.line_buffered && memchr(s, '\n', length)) {
+    output_flush();
+  }
+}
+
+// Standard input is read in bulk with read(2) into a buffer of the
+// runtime, or mapped at once when it is a regular file, so that getting
+// a character only moves a pointer. The buffer grows as needed to hold
+// a whole line or the whole input.
+#define INPUT_SIZE (64 << 10)
+
+static struct {
+  int initialized;
+  int eof;
+  // Mapping of standard input, or NULL when reading into the buffer.
+  void *map;
+  size_t map_size;
+  char *buffer;
+  size_t capacity;
+  // Characters read but not consumed yet.
+  const char *next;
+  const char *end;
+} input;
+
+// Map standard input if it is a regular file with something left to
+// read. The whole file is then consumed as far as other readers of the
+// same file description are concerned.
+static int input_map(void) {
+  struct stat st;
+  off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+  if (offset < 0 || fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) ||
+      st.st_size <= offset) {
+    return 0;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+  input.map = map;
+  input.map_size = st.st_size;
+  input.next = (const char *)map + offset;
+  input.end = (const char *)map + st.st_size;
+  lseek(STDIN_FILENO, st.st_size, SEEK_SET);
+  return 1;
+}
+
+// Read more characters after the ones not consumed yet, which may move.
+// Return 0 if there is nothing more to read.
+static int input_fill(void) {
+  if (!input.initialized) {
+    input.initialized = 1;
+    if (input_map()) {
+      return 1;
+    }
+  }
+  if (input.eof) {
+    return 0;
+  }
+
+  // Keep reading after the mapping only if the file has grown since.
+  if (input.map) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) || st.st_size <= (off_t)input.map_size) {
+      input.eof = 1;
+      return 0;
+    }
+  }
+
+  size_t kept = input.end - input.next;
+  if (!input.map && kept) {
+    memmove(input.buffer, input.next, kept);
+  }
+  if (kept + INPUT_SIZE > input.capacity) {
+    input.capacity *= 2;
+    if (input.capacity < kept + INPUT_SIZE) {
+      input.capacity = kept + INPUT_SIZE;
+    }
+    input.buffer = realloc(input.buffer, input.capacity);
+    if (!input.buffer) {
+      error("out of memory");
+    }
+  }
+  if (input.map) {
+    memcpy(input.buffer, input.next, kept);
+    munmap(input.map, input.map_size);
+    input.map = NULL;
+  }
+  input.next = input.buffer;
+  input.end = input.buffer + kept;
+
+  // A prompt must be visible before waiting for the user.
+  if (output.line_buffered) {
+    output_flush();
+  }
+  for (;;) {
+    ssize_t length = read(STDIN_FILENO, input.buffer + kept,
+                          input.capacity - kept);
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+    if (length <= 0) {
+      input.eof = 1;
+      return 0;
+    }
+    input.end += length;
+    return 1;
+  }
+}
+
+// Consume the next length characters of standard input and return them
+// as a string.
+static const char *input_string(size_t length) {
+  if (length > INT32_MAX) {
+    error("input too large");
+  }
+  const char *s;
+  if (length <= SMALL_STRING_LENGTH) {
+    s = small_string(input.next, length);
+  } else {
+    char *copy = alloc_string(length);
+    chars_copy(copy, input.next, length);
+    s = copy;
+  }
+  input.next += length;
+  return s;
+}
+
 void __print_err(const char *s) {
-  fprintf(stderr, "%s", s);
+  char buffer[SMALL_STRING_LENGTH];
+  fwrite(string_chars(s, buffer), 1, STRING_LENGTH(s), stderr);
 }
 
 void __print(const char *s) {
-  fprintf(stdout, "%s", s);
+  char buffer[SMALL_STRING_LENGTH];
+  output_write(string_chars(s, buffer), STRING_LENGTH(s));
 }
 
 void __print_int(const int32_t i) {
-  fprintf(stdout, "%d", i);
+  static const char pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+  // The digits are written two at a time from the end, the absolute
+  // value of INT32_MIN only fits unsigned.
+  char buffer[11];
+  char *p = buffer + sizeof(buffer);
+  uint32_t n = i < 0 ? -(uint32_t)i : (uint32_t)i;
+  while (n >= 100) {
+    const char *pair = pairs + (n % 100) * 2;
+    n /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if (n >= 10) {
+    *--p = pairs[n * 2 + 1];
+    *--p = pairs[n * 2];
+  } else {
+    *--p = '0' + n;
+  }
+  if (i < 0) {
+    *--p = '-';
+  }
+  output_write(p, buffer + sizeof(buffer) - p);
 }
 
 void __flush(void) {
-  fflush(stdout);
+  output_flush();
 }
 
 const char *__getchar(void) {
-  char str[2];
-  // Return null character
-  if(!fgets(str, 2, stdin)) {
-    char * myStr = malloc(sizeof(char));
-    *myStr = '\0';
-    return myStr;
-  }
-  // Return the first character with the terminating null character
-  else {
-    char * myStr = malloc(2*sizeof(char));
-    *myStr = *str;
-    return myStr;
+  // Return the empty string at end of file
+  if (input.next == input.end && !input_fill()) {
+    return empty_string();
+  }
+  return char_string(*input.next++);
+}
+
+const char *__read_line(void) {
+  size_t length = 0;
+  for (;;) {
+    size_t available = input.end - input.next;
+    if (length < available) {
+      const char *newline =
+          memchr(input.next + length, '\n', available - length);
+      if (newline) {
+        length = newline + 1 - input.next;
+        break;
+      }
+      length = available;
+    }
+    if (!input_fill()) {
+      break;
+    }
   }
+  return input_string(length);
+}
+
+const char *__read_all(void) {
+  while (input_fill()) {
+  }
+  return input_string(input.end - input.next);
 }
 
 int32_t __ord(const char *s) {
-  if(!s[0]) {
+  if(!STRING_LENGTH(s)) {
     return -1;
   }
   else {
-    return (unsigned char)s[0];
+    return (unsigned char)first_char(s);
   }
 }
 
 const char *__chr(int32_t i) {
-  char * myStr = malloc(2*sizeof(char));
-  if(i == 0) {
-    myStr[0] = '\0';	  
-  }
-  else if(i < 0 || i > 255) {
+  if(i < 0 || i > 255) {
     exit(EXIT_FAILURE);
   }
-  else {
-    myStr[0] = (char)i;
+  if(i == 0) {
+    return empty_string();
   }
-  return myStr;
+  return char_string(i);
 }
 
 int32_t __size(const char *s) {
-  return strlen(s);
+  return STRING_LENGTH(s);
 }
 
 const char *__substring(const char *s, int32_t first, int32_t length) {
   if(first < 0 || length <0) {
     exit(EXIT_FAILURE);
   }
-  if(strlen(s) < length + first) {
+  if(STRING_LENGTH(s) - first < length) {
     exit(EXIT_FAILURE);
   }
- 
-  char * myStr = malloc((length+1)*sizeof(char));
-  for(int i = 0; i < length; i++) {
-    myStr[i] = s[first + i];
+  if(length <= (int32_t)SMALL_STRING_LENGTH) {
+    return STRING_IS_SMALL(s) ? small_substring(s, first, length)
+                              : small_string(string_chars(s, NULL) + first,
+                                             length);
   }
+  const char *chars = string_chars(s, NULL);
 
-  myStr[length] = '\0';
+  held[0] = s;
+  if(length >= VIEW_LENGTH) {
+    struct view *view = alloc_view(length);
+    held[0] = NULL;
+    view->chars[0] = chars[first];
+    view->parent = flat_parent(s);
+    view->start = chars + first;
+    return view->chars;
+  }
+  char * myStr = alloc_string(length);
+  held[0] = NULL;
+  chars_copy(myStr, chars + first, length);
   return myStr;
 }
 
-const char *__concat(const char *s1, const char *s2) {
-  char * myStr = malloc((strlen(s1) + strlen(s2))*sizeof(char));
-  for(int i = 0; i < strlen(s1); i++) {
-    myStr[i] = s1[i];
+// Concatenate two non-empty strings too short to build a rope, which
+// the caller holds as they may be collected otherwise.
+static const char *concat_flat(const char *s1, int32_t l1, const char *s2,
+                               int32_t l2) {
+  if(l1 + l2 <= (int32_t)SMALL_STRING_LENGTH) {
+    // Both operands are small as well.
+    uintptr_t chars = (uintptr_t)s1 >> 8 | (uintptr_t)s2 >> 8 << 8 * l1;
+    return (const char *)(chars << 8 | (uintptr_t)(l1 + l2) << 1 | 1);
   }
+  // Both operands are shorter than a rope, so getting their characters
+  // never flattens anything.
+  char * myStr = alloc_string(l1 + l2);
+  char buffer1[SMALL_STRING_LENGTH];
+  char buffer2[SMALL_STRING_LENGTH];
+  chars_copy(myStr, string_chars(s1, buffer1), l1);
+  chars_copy(myStr + l1, string_chars(s2, buffer2), l2);
+  return myStr;
+}
 
-  for(int i = 0; i < strlen(s2); i++) {
-    myStr[strlen(s1) + i] = s2[i];
+const char *__concat(const char *s1, const char *s2) {
+  int32_t l1 = STRING_LENGTH(s1);
+  int32_t l2 = STRING_LENGTH(s2);
+  if(!l1) {
+    return s2;
   }
-  return myStr;
+  if(!l2) {
+    return s1;
+  }
+  held[0] = s1;
+  held[1] = s2;
+  if(l1 + l2 < ROPE_LENGTH) {
+    const char *result = concat_flat(s1, l1, s2, l2);
+    held[0] = held[1] = NULL;
+    return result;
+  }
+  const char *left = rope_child(s1);
+  const char *right = rope_child(s2);
+  // A short piece added next to a short leaf is joined to it, so that
+  // ropes grown a few characters at a time do not get a leaf per piece.
+  // The held operand keeps the other children of its rope alive.
+  struct rope *rope1 = lazy_rope(s1);
+  struct rope *rope2 = lazy_rope(s2);
+  if(rope1 && STRING_LENGTH(rope1->right) + l2 < LEAF_LENGTH) {
+    left = rope1->left;
+    right = concat_flat(rope1->right, STRING_LENGTH(rope1->right), s2, l2);
+    held[1] = right;
+  } else if(rope2 && l1 + STRING_LENGTH(rope2->left) < LEAF_LENGTH) {
+    left = concat_flat(s1, l1, rope2->left, STRING_LENGTH(rope2->left));
+    right = rope2->right;
+    held[0] = left;
+  }
+  struct rope *rope = alloc_rope(l1 + l2);
+  held[0] = held[1] = NULL;
+  rope->chars[0] = first_char(s1);
+  rope->left = left;
+  rope->right = right;
+  return rope->chars;
 }
 
 int32_t __strcmp(const char *s1, const char *s2) {
-  if(!strcmp(s1, s2)) {
-    return 0;
+  int32_t l1 = STRING_LENGTH(s1);
+  int32_t l2 = STRING_LENGTH(s2);
+  int c;
+  if(STRING_IS_SMALL(s1) && STRING_IS_SMALL(s2)) {
+    // With the first character in the most significant byte, the
+    // characters compare as integers, the missing ones being zeros.
+    uintptr_t c1 = small_order(s1);
+    uintptr_t c2 = small_order(s2);
+    c = (c1 > c2) - (c1 < c2);
+  } else {
+    c = strings_compare(s1, s2, l1 < l2 ? l1 : l2, 0);
   }
-  else {
-    if(strcmp(s1, s2) < 0) {
-      return -1;
-    }
-    else {
-      return 1;
-    }
+  if(!c) {
+    c = l1 - l2;
   }
+  return (c > 0) - (c < 0);
 }
 
 int32_t __streq(const char *s1, const char *s2) {
-  if(!strcmp(s1, s2)) {
+  if(s1 == s2) {
     return 1;
   }
-  else {
+  // Strings short enough to be small are always small, so two different
+  // small strings are different.
+  if(STRING_IS_SMALL(s1) || STRING_IS_SMALL(s2)) {
     return 0;
   }
+  int32_t length = STRING_LENGTH(s1);
+  return length == STRING_LENGTH(s2) && !strings_compare(s1, s2, length, 1);
 }
 
 int32_t __not(int32_t i) {
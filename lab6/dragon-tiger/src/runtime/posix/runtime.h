@@ -3,10 +3,74 @@
 
 #include <stdint.h>
 
-// Print a null-terminated string on standard error.
+// Tiger strings are handled as pointers to their NUL-terminated
+// characters, or only to their first character for ropes and views.
+// The length of the string is stored in a header right before the
+// first character, so that it is available in constant time. String
+// literals are emitted with the same layout by the IR generator, with
+// no flags set.
+//
+// Strings of at most SMALL_STRING_LENGTH characters are not stored in
+// memory but in the pointer itself, tagged by its lowest bit which is
+// never set in the address of a string. The rest of the lowest byte
+// holds the length, and the next bytes the characters, starting from
+// the least significant one. Every string this short is small, the IR
+// generator emits such literals the same way.
+struct string_header {
+  uint32_t flags;
+  int32_t length;
+};
+
+// The string belongs to the garbage collected heap.
+#define STRING_HEAP 1
+// The string has been found alive by the current collection.
+#define STRING_MARKED 2
+// The string is a rope: its characters are those of two other strings,
+// only copied when a primitive needs them one after the other.
+#define STRING_ROPE 4
+// The string is a view of the characters of another string.
+#define STRING_VIEW 8
+
+#define SMALL_STRING_LENGTH (sizeof(void *) - 1)
+#define STRING_IS_SMALL(s) ((uintptr_t)(s) & 1)
+
+#define STRING_HEADER(s) ((const struct string_header *)(s) - 1)
+#define STRING_LENGTH(s)                                                \
+  (STRING_IS_SMALL(s) ? (int32_t)(((uintptr_t)(s) & 0xff) >> 1)         \
+                      : STRING_HEADER(s)->length)
+
+// Shadow stack of the garbage collector. Every function holding
+// strings pushes a frame listing the slots where it keeps them, which
+// must be NULL or hold a string, and pops it before returning.
+struct gc_frame {
+  struct gc_frame *prev;
+  int32_t count;
+  const char **roots[];
+};
+
+// Innermost frame of the shadow stack.
+extern struct gc_frame *__gc_roots;
+
+// The collector is tuned through environment variables, sizes are in
+// bytes with an optional k, M or G suffix:
+//
+//   TIGER_GC_HEAP     heap size triggering the first collection (4M)
+//   TIGER_GC_GROWTH   heap size triggering the next collection, as a
+//                     multiple of the heap left by the last one (2)
+//   TIGER_GC_CHUNK    size of the chunks small strings are allocated
+//                     from, 0 to allocate every string on its own (64k)
+//   TIGER_GC_RELEASE  when set, free the whole heap on exit
+//   TIGER_GC_STATS    when set, print collection statistics on exit
+//
+// On x86-64, short strings are compared and copied with vector
+// instructions, AVX2 ones when the processor supports them.
+// TIGER_SIMD=sse2 restricts them to SSE2, TIGER_SIMD=none leaves these
+// operations to the C library.
+
+// Print a string on standard error.
 void __print_err(const char *s);
 
-// Print a null-terminated string on standard output.
+// Print a string on standard output.
 void __print(const char *s);
 
 // Print a 32 bit signed integer on standard output.
@@ -20,8 +84,17 @@ void __flush(void);
 // return the empty string.
 const char *__getchar(void);
 
+// Read a line from standard input and return it, including its
+// terminating newline if there is one, so that only the end of file
+// gives the empty string.
+const char *__read_line(void);
+
+// Read standard input up to the end of file and return it.
+const char *__read_all(void);
+
 // Return the ASCII code of the char in first position
 // in the string, or -1 if the string is empty.
+__attribute__((pure))
 int32_t __ord(const char *s);
 
 // Return a string containing the character whose ASCII
@@ -31,6 +104,7 @@ int32_t __ord(const char *s);
 const char *__chr(int32_t i);
 
 // Return the length of a string.
+__attribute__((pure))
 int32_t __size(const char *);
 
 // Return a substring of s starting at character first
@@ -46,10 +120,13 @@ const char *__substring(const char *s, int32_t first, int32_t length);
 // Concatenate two strings.
 const char *__concat(const char *s1, const char *s2);
 
-// Compare two strings and return -1, 0, or 1.
+// Compare two strings and return -1, 0, or 1. Unlike the other
+// primitives, comparisons walk ropes rather than flattening them.
+__attribute__((pure))
 int32_t __strcmp(const char *s1, const char *s2);
 
 // Check if two strings are equal and return 0 or 1.
+__attribute__((pure))
 int32_t __streq(const char *s1, const char *s2);
 
 // Logical not, return 0 or 1.